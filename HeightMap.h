@@ -1,5 +1,8 @@
 #pragma once
 #include "olcPixelGameEngine.h"
+#include <algorithm>
+#include <limits>
+#include <utility>
 #include <vector>
 
 namespace hm
@@ -21,6 +24,7 @@ namespace hm
                 Gradient(std::vector<float>&& endpoints, std::vector<olc::Pixel>&& colors) : endpoints(endpoints), colors(colors)
                 { 
                         interpMeths = std::vector<interpMeth>(endpoints.size(), linear);
+                        bake();
                 }
 
                 void setInterpolationMethod(interpMeth method, int index = -1)
@@ -32,6 +36,7 @@ namespace hm
                                 interpMeths[index] = method;
                         else
                                 std::cout << "Invalid index\n";
+                        bake();
                 }
 
                 void setAllInterpolationMethod(const std::vector<interpMeth>& methods)
@@ -40,6 +45,64 @@ namespace hm
                         {
                                 interpMeths[i] = methods[i];
                         }
+                        bake();
+                }
+
+                // Appends the open ranges of values getColor gives a single color for: below
+                // the first and above the last endpoint, and segments with none or abrupt
+                // interpolation (split at their middle). Neighbours of the same color are merged.
+                // lookup gives that color on them too, their ends are in exact table steps.
+                void flatRanges(std::vector<std::pair<float, float>>& ranges) const
+                {
+                        const float inf = std::numeric_limits<float>::infinity();
+
+                        std::vector<std::pair<float, float>> found;
+                        std::vector<olc::Pixel> foundColors;
+                        auto add = [&](float lo, float hi, olc::Pixel color)
+                        {
+                                if(!found.empty() && found.back().second == lo && foundColors.back() == color)
+                                        found.back().second = hi;
+                                else
+                                {
+                                        found.push_back({ lo, hi });
+                                        foundColors.push_back(color);
+                                }
+                        };
+
+                        add(-inf, endpoints[0], colors[0]);
+                        for(size_t i = 0; i + 1 < endpoints.size(); i++)
+                        {
+                                if(interpMeths[i] == none)
+                                        add(endpoints[i], endpoints[i+1], colors[i]);
+                                else if(interpMeths[i] == abrupt)
+                                {
+                                        float middle = 0.5f * (endpoints[i] + endpoints[i+1]);
+                                        add(endpoints[i], middle, colors[i]);
+                                        add(middle, endpoints[i+1], colors[i+1]);
+                                }
+                        }
+                        add(endpoints.back(), inf, colors.back());
+
+                        ranges.insert(ranges.end(), found.begin(), found.end());
+                }
+
+                // getColor from the lookup table. The steps around endpoints and abrupt
+                // middles, where the color can jump, call getColor, so hard edges stay where
+                // they are; elsewhere it's getColor half a table step away at most. On the
+                // default gradients that's 1 color level off for linear, 2 for squared and
+                // smooth and 3 at the steep ends of cubed.
+                olc::Pixel lookup(float value) const
+                {
+                        float f = std::min(std::max((value - lutStart) * lutScale + 1.0f, 0.0f), float(lutSize + 1));
+                        olc::Pixel color = lut[(int)f];
+                        return (color.a == exact ? getColor(value) : color);
+                }
+
+                // lookup for n values at once
+                void getColors(const float* values, olc::Pixel* out, int n) const
+                {
+                        for(int i = 0; i < n; i++)
+                                out[i] = lookup(values[i]);
                 }
 
         private:
@@ -49,8 +112,44 @@ namespace hm
 
                 std::vector<interpMeth> interpMeths;
 
+                // getColor sampled at the middles of lutSize steps over the endpoints, with the
+                // colors below and above them at both ends. Steps lookup has to leave to
+                // getColor have an alpha of exact (getColor's colors are opaque).
+                static constexpr int lutSize = 4096;
+                static constexpr uint8_t exact = 0;
+                std::vector<olc::Pixel> lut;
+                float lutStart = 0.0f;
+                float lutScale = 0.0f; // table steps per unit of value
+
+                void bake()
+                {
+                        lutStart = endpoints[0];
+                        lutScale = lutSize / (endpoints.back() - endpoints[0]);
+
+                        lut.resize(lutSize + 2);
+                        lut[0] = colors[0];
+                        for(int i = 1; i <= lutSize; i++)
+                                lut[i] = getColor(lutStart + (float(i) - 0.5f) / lutScale);
+                        lut[lutSize + 1] = colors.back();
+
+                        // the step of a hard edge and its neighbours, in case rounding puts
+                        // a value next to it in one of them
+                        auto markEdge = [&](float edge)
+                        {
+                                int step = (int)((edge - lutStart) * lutScale + 1.0f);
+                                for(int i = std::max(step - 1, 0); i <= std::min(step + 1, lutSize + 1); i++)
+                                        lut[i].a = exact;
+                        };
+                        for(size_t i = 0; i < endpoints.size(); i++)
+                        {
+                                markEdge(endpoints[i]);
+                                if(i + 1 < endpoints.size() && interpMeths[i] == abrupt)
+                                        markEdge(0.5f * (endpoints[i] + endpoints[i+1]));
+                        }
+                }
+
         public:
-                olc::Pixel getColor(float value)
+                olc::Pixel getColor(float value) const
                 {
                         if(value < endpoints[0])
                                 return colors[0];
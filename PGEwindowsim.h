@@ -76,6 +76,8 @@ int main()
 
 #pragma once
 #include "olcPixelGameEngine.h"
+#include <algorithm>
+#include <cstring>
 #include <unordered_map>
 #include <stdexcept>
 
@@ -91,6 +93,25 @@ namespace PGEws
                 CanResizeY = 8,
         };
 
+        //The pixels of a window's content, row y starts at data + y*stride
+        //Valid until the window is resized
+        struct PixelSpan
+        {
+                olc::Pixel* data;
+                int width;
+                int height;
+                int stride;
+
+                olc::Pixel* row(int y) const { return data + y*stride; }
+        };
+
+        //A part of a window's content that changed during the last updateAll, in screen pixels
+        struct DirtyRegion
+        {
+                unsigned int id;
+                int x, y, w, h;
+        };
+
         class Window
         {
                 friend class WindowList;
@@ -143,6 +164,9 @@ namespace PGEws
 
                 bool destruct = false;
 
+                bool dirty = false;
+                int dirtyX0, dirtyY0, dirtyX1, dirtyY1;
+
                 public:
                 olc::vi2d lGetMousePos();
                 int lGetMouseX();
@@ -173,9 +197,18 @@ namespace PGEws
 
                 void drawBorder();
 
+                void drawContent();
+
                 public:
                 void lClear(olc::Pixel color);
 
+                //Direct access to the content's pixels, for writing whole rows without pge->Draw
+                //Whatever is written through it should be reported with lMarkDirty
+                PixelSpan lGetPixels();
+
+                void lMarkDirty(int x, int y, int w, int h);
+                void lMarkDirty();
+
 
                 void changePermissions(int flags);
 
@@ -216,6 +249,9 @@ namespace PGEws
 
                         std::vector<Window*> windowList;
 
+                        //Filled by updateAll
+                        std::vector<DirtyRegion> dirtyRegions;
+
                 private:
                         std::list<int> orderedIndices;
 
@@ -395,9 +431,73 @@ namespace PGEws
                 pge->DrawRect(posX - 1, posY - 1, sizeX*scale + 1, sizeY*scale + 1, (inFocus ? olc::Pixel(110,110,110) : olc::Pixel(50, 50, 50)));
         }
 
+        //Same as pge->DrawSprite(posX, posY, content.get(), scale), but in the normal pixel mode the
+        //content is opaque, so its rows are copied (or each pixel repeated scale times) into the screen
+        void Window::drawContent()
+        {
+                olc::Sprite* screen = pge->GetDrawTarget();
+                if (screen == nullptr || pge->GetPixelMode() != olc::Pixel::NORMAL)
+                {
+                        pge->DrawSprite(posX, posY, content.get(), scale);
+                        return;
+                }
+
+                int s = std::max(scale, 1);
+
+                //The part of the screen the content covers
+                int x0 = std::max(posX, 0), x1 = std::min(posX + content->width*s, screen->width);
+                int y0 = std::max(posY, 0), y1 = std::min(posY + content->height*s, screen->height);
+                if (x0 >= x1 || y0 >= y1)
+                        return;
+
+                for (int y = y0; y < y1; y++)
+                {
+                        olc::Pixel* line = &screen->pColData[y*screen->width];
+
+                        //The rows of one content row after the first are copies of it
+                        if (y > y0 && (y - posY) % s != 0)
+                        {
+                                std::memcpy(line + x0, line + x0 - screen->width, (x1 - x0)*sizeof(olc::Pixel));
+                                continue;
+                        }
+
+                        const olc::Pixel* row = &content->pColData[((y - posY)/s)*content->width];
+                        if (s == 1)
+                        {
+                                std::memcpy(line + x0, row + (x0 - posX), (x1 - x0)*sizeof(olc::Pixel));
+                                continue;
+                        }
+
+                        for (int i = (x0 - posX)/s; posX + i*s < x1; i++)
+                                std::fill(line + std::max(posX + i*s, x0), line + std::min(posX + (i + 1)*s, x1), row[i]);
+                }
+        }
+
 
         void Window::lClear(olc::Pixel color) { pge->FillRect(0, 0, sizeX, sizeY, color); }
 
+        PixelSpan Window::lGetPixels() { return { content->pColData.data(), sizeX, sizeY, content->width }; }
+
+        void Window::lMarkDirty(int x, int y, int w, int h)
+        {
+                int x0 = std::max(x, 0), y0 = std::max(y, 0);
+                int x1 = std::min(x + w, sizeX), y1 = std::min(y + h, sizeY);
+                if (x0 >= x1 || y0 >= y1)
+                        return;
+
+                if (!dirty)
+                {
+                        dirtyX0 = x0; dirtyY0 = y0; dirtyX1 = x1; dirtyY1 = y1;
+                        dirty = true;
+                        return;
+                }
+
+                dirtyX0 = std::min(dirtyX0, x0); dirtyY0 = std::min(dirtyY0, y0);
+                dirtyX1 = std::max(dirtyX1, x1); dirtyY1 = std::max(dirtyY1, y1);
+        }
+
+        void Window::lMarkDirty() { lMarkDirty(0, 0, sizeX, sizeY); }
+
         void Window::changePermissions(int flags)
         {
                 canClose = flags & PGEws::CanClose;
@@ -491,10 +591,16 @@ namespace PGEws
                 pge->SetDrawTarget(nullptr);
                 if (!hidden)
                 {
-                        pge->DrawSprite(posX, posY, content.get(), scale);
+                        drawContent();
                         drawBanner();
                         drawBorder();
                 }
+
+                if (dirty)
+                {
+                        parentWindowList->dirtyRegions.push_back({ id, posX + dirtyX0*scale, posY + dirtyY0*scale, (dirtyX1 - dirtyX0)*scale, (dirtyY1 - dirtyY0)*scale });
+                        dirty = false;
+                }
         }
 
         //WindowList implementation
@@ -523,6 +629,7 @@ namespace PGEws
 
                 moveWindows();
 
+                dirtyRegions.clear();
                 for (auto i = orderedIndices.rbegin(); i != orderedIndices.rend(); i++)
                         windowList[*i]->update(fElapsedTime);
 
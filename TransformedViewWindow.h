@@ -1,6 +1,9 @@
 #pragma once
 #include "olcPixelGameEngine.h"
 #include "PGEWindowSim.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 class TransformedViewWindow
 {
@@ -41,38 +44,23 @@ public:
 
         olc::vi2d DrawSprite(int pixel_X, int pixel_Y, olc::Sprite* spr)
 	{
-		//if(pge->GetKey(olc::Key::S).bPressed)
-		//	std::cout << "scale: " << scale << "\n";
-		//if(pge->GetKey(olc::X).bPressed)
-		//	std::cout << pixel_X << "\n";
-		//if(pge->GetKey(olc::Y).bPressed)
-		//	std::cout << pixel_Y << "\n";
-
 		if(scale < 1.6f) //this used to be for scale < 1.0f, but strangely i've found it also works quite well for values between 1.0 and 1.6
-//                if(pge->GetKey(olc::Key::SPACE).bHeld)
 		{
 			int width = int((float)spr->Size().x * scale);
 			int height = int((float)spr->Size().y * scale);
 
-                        int x = (pixel_X < 0 ? -pixel_X : 0);
-                        int y = (pixel_Y < 0 ? -pixel_Y : 0);
-			for(; y < height; y++)
-			{
-				if(pixel_Y + y > win->WindowHeight())
-                                {
-                                        return {pixel_X + x - 1, pixel_Y + y - 1};
-                                }
-
-				for(x = (pixel_X < 0 ? -pixel_X : 0); x < width; x++)
-				{
-					if(pixel_X + x > win->WindowWidth())
-						break;
-
-					win->pge->Draw(pixel_X + x, pixel_Y + y, spr->GetPixel(x/scale, y/scale));
-				}
-			}
+                        int x0 = (pixel_X < 0 ? -pixel_X : 0);
+                        int y0 = (pixel_Y < 0 ? -pixel_Y : 0);
+
+                        // it has always drawn up to and including the pixel at WindowWidth(), WindowHeight()
+                        int x1 = std::max(x0, std::min(width, win->WindowWidth() + 1 - pixel_X));
+                        int y1 = std::max(y0, std::min(height, win->WindowHeight() + 1 - pixel_Y));
 
-                        return {pixel_X + x - 1, pixel_Y + y - 1};
+                        sampleRuns(columns, pixel_X, x0, x1);
+                        sampleRuns(rows, pixel_Y, y0, y1);
+                        drawRuns(spr);
+
+                        return {pixel_X + (y1 > y0 ? x1 : x0) - 1, pixel_Y + y1 - 1};
 		}
 		else // optimization for when zoomed in (a lot)
 		{
@@ -83,60 +71,122 @@ public:
 
                         const float min_y = (pixel_Y < 0 ? (float)pixel_Y - int(pixel_Y/scale) * scale : pixel_Y);
 			const float min_x = (pixel_X < 0 ? (float)pixel_X - int(pixel_X/scale) * scale : pixel_X);
-			float x = min_x;
-			float y = min_y;
 
 			const int min_u = (pixel_X < 0 ? float(-pixel_X)/scale : 0);
 			const int min_v = (pixel_Y < 0 ? float(-pixel_Y)/scale : 0);
 
-                        int scaledWidth;
-                        int scaledHeight;
-
-			for(int v = min_v; v < height; v++)
-			{
-				if(y >= win->WindowHeight())
-                                {
-//                                        int upperLeft_x = int(min_x);
-//                                        int upperLeft_y = int(min_y);
-
-                                        x -= scale; y -= scale;
+                        int scaledWidth = 0;
+                        int scaledHeight = 0;
+                        float x = texelRuns(columns, min_x, min_u, width, win->WindowWidth(), scaledWidth);
+                        float y = texelRuns(rows, min_y, min_v, height, win->WindowHeight(), scaledHeight);
+                        if(rows.empty())
+                                x = min_x;
 
-                                        int bottomRight_x = (int)x + scaledWidth;
-                                        int bottomRight_y = (int)y + scaledHeight;
+                        drawRuns(spr);
 
-                                        return {bottomRight_x - 1, bottomRight_y - 1};
-                                }
-
-				x = min_x;
-
-				scaledHeight = int(y + scale) - int(y);
-
-				for(int u = min_u; u < width; u++)
-				{
-					if(x >= win->WindowWidth())
-						break;
-
-					scaledWidth = int(x + scale) - int(x);
-
-					win->pge->FillRect((int)x, (int)y, scaledWidth, scaledHeight, spr->GetPixel(u, v));
-
-					x += scale;
-				}
+                        // the bottom right of the last texel drawn
+                        return {(int)(x - scale) + scaledWidth - 1, (int)(y - scale) + scaledHeight - 1};
+		}
+	}
 
-				y += scale;
-			}
+private:
+        // a texel of the sprite covering the pixels begin .. end - 1 of a row or a column of the draw target
+        struct Run
+        {
+                int texel;
+                int begin, end;
+        };
 
-                        x -= scale; y -= scale;
+        std::vector<Run> columns, rows;
 
-                        int bottomRight_x = (int)x + scaledWidth;
-                        int bottomRight_y = (int)y + scaledHeight;
+        // the texels of the pixels from + first .. from + last - 1 when minifying,
+        // pixel i shows texel int(i / scale) in float, as GetPixel was called with it
+        void sampleRuns(std::vector<Run>& runs, int from, int first, int last)
+        {
+                runs.clear();
+                for(int i = first; i < last; i++)
+                {
+                        int texel = int(i / scale);
+                        if(!runs.empty() && runs.back().texel == texel && runs.back().end == from + i)
+                                runs.back().end++;
+                        else
+                                runs.push_back({ texel, from + i, from + i + 1 });
+                }
+        }
 
-                        return {bottomRight_x - 1, bottomRight_y - 1};
-		}
+        // the texels first .. count - 1 when magnifying, the first one starting at
+        // pixel start and each scale pixels wide, up to the one that starts at limit;
+        // returns where the one after the last starts, and the last one's size. The
+        // edges are accumulated in float, as FillRect was called per texel with them.
+        float texelRuns(std::vector<Run>& runs, float start, int first, int count, int limit, int& lastSize)
+        {
+                runs.clear();
+                float edge = start;
+                for(int texel = first; texel < count && edge < limit; texel++)
+                {
+                        int begin = int(edge);
+                        lastSize = int(edge + scale) - begin;
+                        edge += scale;
+                        runs.push_back({ texel, begin, begin + lastSize });
+                }
+                return edge;
+        }
 
-                return {0,0};
-	}
+        // Draws every texel of rows x columns. The target is written directly a row at a
+        // time, a run of rows showing the same texels is its first row copied; other
+        // pixel modes blend per pixel.
+        void drawRuns(olc::Sprite* spr)
+        {
+                olc::PixelGameEngine* pge = win->pge;
+                olc::Sprite* target = pge->GetDrawTarget();
+                if(!target)
+                        return;
+
+                // clipped to the target
+                int targetWidth = target->width, targetHeight = target->height;
+                auto clip = [](std::vector<Run>& runs, int size)
+                {
+                        size_t kept = 0;
+                        for(Run run : runs)
+                        {
+                                run.begin = std::max(run.begin, 0);
+                                run.end = std::min(run.end, size);
+                                if(run.begin < run.end)
+                                        runs[kept++] = run;
+                        }
+                        runs.resize(kept);
+                };
+                clip(columns, targetWidth);
+                clip(rows, targetHeight);
+
+                bool opaque = (pge->GetPixelMode() == olc::Pixel::NORMAL);
+                for(const Run& row : rows)
+                {
+                        const olc::Pixel* texels = &spr->pColData[row.texel * spr->width];
+
+                        if(!opaque)
+                        {
+                                for(int y = row.begin; y < row.end; y++)
+                                        for(const Run& column : columns)
+                                                for(int x = column.begin; x < column.end; x++)
+                                                        pge->Draw(x, y, texels[column.texel]);
+                                continue;
+                        }
+
+                        olc::Pixel* line = &target->pColData[row.begin * targetWidth];
+                        for(const Run& column : columns)
+                                std::fill(line + column.begin, line + column.end, texels[column.texel]);
+
+                        if(columns.empty())
+                                continue;
+
+                        int first = columns.front().begin, count = columns.back().end - first;
+                        for(int y = row.begin + 1; y < row.end; y++)
+                                std::memcpy(&target->pColData[y * targetWidth + first], line + first, count * sizeof(olc::Pixel));
+                }
+        }
 
+public:
 	olc::vf2d PixelToWorld(olc::vi2d PixelPos)
 	{
 		return (olc::vf2d(PixelPos) / (W * scale) + offset);
@@ -212,6 +262,12 @@ public:
 
         float getScale() { return scale; }
 
+        // screen pixels per world unit
+        float pixelsPerUnit() { return W * scale; }
+        float pixelsPerUnit(float atScale) { return W * atScale; }
+
+        olc::vf2d getOffset() { return offset; }
+
         void setOffset(olc::vf2d newOffset) { offset = newOffset; }
 };
 
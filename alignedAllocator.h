@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// std::vector allocator handing out cache line aligned blocks, so that SIMD loads
+// and lattice rows never straddle more cache lines than they have to.
+template<class T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+        typedef T value_type;
+
+        AlignedAllocator() noexcept {}
+        template<class U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) noexcept {}
+
+        template<class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+        T* allocate(std::size_t n)
+        {
+                return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+        }
+
+        void deallocate(T* p, std::size_t) noexcept
+        {
+                ::operator delete(p, std::align_val_t(Alignment));
+        }
+
+        template<class U> bool operator==(const AlignedAllocator<U, Alignment>&) const noexcept { return true; }
+        template<class U> bool operator!=(const AlignedAllocator<U, Alignment>&) const noexcept { return false; }
+};
+
+template<class T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
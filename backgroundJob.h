@@ -0,0 +1,120 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A background thread running one job at a time. A job gets a flag it has to check
+// often (say once per row) and returns false as soon as it's set; it returns true
+// if it ran to completion. The owner collects completed jobs with collect().
+class BackgroundJob
+{
+public:
+        typedef std::function<bool(const std::atomic<bool>& cancelled)> Job;
+
+        BackgroundJob() : thread(&BackgroundJob::work, this) {}
+
+        ~BackgroundJob()
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        quit = true;
+                        cancelled = true;
+                }
+                wake.notify_all();
+                thread.join();
+        }
+
+        BackgroundJob(const BackgroundJob&) = delete;
+        BackgroundJob& operator=(const BackgroundJob&) = delete;
+
+        // the previous job has to be collected or cancelled first
+        void start(Job newJob)
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        job = std::move(newJob);
+                        queued = true;
+                        state = running;
+                        cancelled = false;
+                }
+                wake.notify_all();
+        }
+
+        bool busy()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                return state == running;
+        }
+
+        // true once for every job that ran to completion
+        bool collect()
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(state != completed)
+                        return false;
+                state = idle;
+                return true;
+        }
+
+        // Stops the running job and drops an uncollected result. Only waits for the
+        // job to notice the flag. Returns whether there was a job or result to drop.
+        bool cancel()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                if(state == idle)
+                        return false;
+
+                if(queued)
+                {
+                        queued = false;
+                        job = nullptr;
+                }
+                else
+                {
+                        cancelled = true;
+                        finished.wait(lock, [this] { return state != running; });
+                }
+
+                state = idle;
+                return true;
+        }
+
+private:
+        enum State { idle, running, completed };
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+
+        Job job;
+        bool queued = false; // started, but not picked up by the thread yet
+        State state = idle;
+        bool quit = false;
+        std::atomic<bool> cancelled { false };
+
+        std::thread thread; // last, so everything above exists before it runs
+
+        void work()
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                for(;;)
+                {
+                        wake.wait(lock, [this] { return quit || queued; });
+                        if(quit)
+                                return;
+
+                        Job current = std::move(job);
+                        job = nullptr;
+                        queued = false;
+
+                        lock.unlock();
+                        bool done = current(cancelled);
+                        lock.lock();
+
+                        state = (done && !cancelled ? completed : idle);
+                        finished.notify_all();
+                }
+        }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+// Runtime detection of the instruction sets the noise kernels can use.
+// Define PERLIN_NO_SIMD to force the scalar code everywhere.
+
+#if !defined(PERLIN_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PERLIN_X86_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define PERLIN_X86_SIMD 0
+#endif
+
+// MSVC lets any function use AVX2 intrinsics, GCC and Clang need them marked
+#if PERLIN_X86_SIMD && (defined(__GNUC__) || defined(__clang__))
+#define PERLIN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PERLIN_TARGET_AVX2
+#endif
+
+namespace cpu
+{
+        inline bool detectAVX2()
+        {
+#if !PERLIN_X86_SIMD
+                return false;
+#elif defined(_MSC_VER)
+                int regs[4];
+                __cpuid(regs, 0);
+                if(regs[0] < 7)
+                        return false;
+
+                __cpuid(regs, 1);
+                bool osxsave = (regs[2] & (1 << 27)) != 0;
+                bool avx = (regs[2] & (1 << 28)) != 0;
+                if(!osxsave || !avx)
+                        return false;
+                if((_xgetbv(0) & 6) != 6) // the OS has to save the ymm registers
+                        return false;
+
+                __cpuidex(regs, 7, 0);
+                return (regs[1] & (1 << 5)) != 0;
+#else
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx2");
+#endif
+        }
+
+        inline bool hasAVX2()
+        {
+                static const bool value = detectAVX2();
+                return value;
+        }
+
+        inline bool hasSSE2()
+        {
+                return PERLIN_X86_SIMD;
+        }
+}
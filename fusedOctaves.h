@@ -0,0 +1,231 @@
+#pragma once
+#include "perlinOctave.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Sums all octaves of a map row in one pass. sumRow<N> is instantiated for every
+// octave count, so the octave loop is unrolled and the per octave row state
+// stays in registers/L1 while a block of pixels is accumulated.
+namespace fused
+{
+        constexpr int maxOctaves = 20;
+        constexpr int blockSize = 64;
+
+        // |noise| of an octave is at most sqrt(1/2) (at a cell centre with every gradient pointing away)
+        constexpr float noiseBound = 0.70711f;
+
+        struct Counters
+        {
+                std::atomic<uint64_t> evaluated { 0 }; // octave samples
+                std::atomic<uint64_t> skipped { 0 };
+        };
+
+        // Lets sumRow stop summing the octaves of a pixel once the rest can't change what
+        // it shows: when the value is past +-1 by more than the rest can add (it gets
+        // clamped to exactly +-1), or when every value it can still reach is inside one
+        // flat range, where the coloring gives one color. Stopped pixels of a flat range
+        // keep their partial value.
+        struct Termination
+        {
+                float remaining[maxOctaves]; // bound of 1.4 * the octaves after octave i
+                bool checked[maxOctaves];    // a pixel can be decided after octave i at all
+                std::vector<std::pair<float, float>> flat[maxOctaves]; // the flat ranges wide enough to decide a pixel after octave i
+                Counters* counters = nullptr;
+
+                // flatRanges are open ranges of final values (in any order)
+                void prepare(const float* ampl, int numOctaves, const std::vector<std::pair<float, float>>& flatRanges)
+                {
+                        float rest = 0.0f;
+                        for(int i = numOctaves - 1; i >= 0; i--)
+                        {
+                                // the slack covers the rounding of the float sum
+                                remaining[i] = 1.4f * noiseBound * rest + 1e-4f;
+                                rest += ampl[i];
+                        }
+
+                        float reach = 0.0f; // bound of 1.4 * the octaves up to octave i
+                        for(int i = 0; i < numOctaves; i++)
+                        {
+                                reach += 1.4f * noiseBound * ampl[i];
+
+                                flat[i].clear();
+                                for(const std::pair<float, float>& range : flatRanges)
+                                        if(range.second - range.first > 2.0f * remaining[i] && range.first < 1.0f && range.second > -1.0f)
+                                                flat[i].push_back(range);
+
+                                checked[i] = (i < numOctaves - 1 && (reach > 1.0f + remaining[i] || !flat[i].empty()));
+                        }
+                }
+
+                // flags the sums (before the 1.4 scale) of a block that are decided after octave,
+                // returns how many of the first count are. Branch free over all blockSize
+                // lanes, one range at a time, so the loops vectorize.
+                int decide(const float* sums, int octave, unsigned char* done, int count) const
+                {
+                        float r = remaining[octave];
+                        for(int x = 0; x < blockSize; x++)
+                        {
+                                float v = sums[x] * 1.4f;
+                                done[x] = (v - r > 1.0f) | (v + r < -1.0f);
+                        }
+
+                        for(const std::pair<float, float>& range : flat[octave])
+                                for(int x = 0; x < blockSize; x++)
+                                {
+                                        float v = sums[x] * 1.4f;
+                                        float lo = std::max(v - r, -1.0f), hi = std::min(v + r, 1.0f);
+                                        done[x] |= (range.first < lo) & (hi < range.second);
+                                }
+
+                        int decided = 0;
+                        for(int x = 0; x < blockSize; x++)
+                                decided += done[x] & (x < count);
+                        return decided;
+                }
+        };
+
+        // ampl[i] is the weight of octave i, xs have to be wrapped with perlinOctave::wrapCoord.
+        // Writes the final map value (scaled by 1.4 and clamped to [-1, 1]). start, if given,
+        // is the sum of the octaves evaluated elsewhere (before the 1.4 scale), it may be out.
+        typedef void (*RowFunction)(const perlinOctave* octaves, const float* ampl, const float* xs, float y, float* out, int n,
+                                    const Termination* termination, const float* start);
+
+        // Accumulates the octaves of a block for the pixels that aren't decided yet. After
+        // each octave the decided ones are dropped from the packed lists, so the octaves
+        // after it run on fewer pixels (with the same operations per pixel). The lists are
+        // padded to whole SIMD vectors (with valid coordinates) and the checks run on all
+        // blockSize lanes, so that neither needs a scalar tail. Dropping pixels only pays
+        // when it saves a whole vector; decided pixels that are kept just get the exact sum.
+        // lanes of whole 8 wide vectors covering count
+        inline int vectors(int count) { return std::min((count + 7) & ~7, blockSize); }
+
+        template<int N>
+        int sumBlockTerminating(const perlinOctave::RowState* rows, const float* ampl, const float* xs, float* acc, int count,
+                                const Termination& termination, const float* start)
+        {
+                const perlinOctave::RowKernel accumulate = perlinOctave::accumulateKernel();
+
+                int index[blockSize];
+                float packedX[blockSize], packedAcc[blockSize];
+                unsigned char done[blockSize];
+                for (int x = 0; x < blockSize; x++)
+                {
+                        index[x] = x;
+                        packedX[x] = xs[x < count ? x : 0];
+                        packedAcc[x] = (start && x < count ? start[x] : 0.0f);
+                }
+
+                int active = count;
+                int skipped = 0;
+                for (int i = 0; i < N && active > 0; i++)
+                {
+                        accumulate(rows[i], packedX, ampl[i], packedAcc, vectors(active));
+                        if (!termination.checked[i])
+                                continue;
+
+                        int decided = termination.decide(packedAcc, i, done, active);
+                        if (vectors(active - decided) == vectors(active))
+                                continue;
+
+                        // branch free, whether a pixel stays is unpredictable
+                        int kept = 0;
+                        for (int x = 0; x < active; x++)
+                        {
+                                acc[index[x]] = packedAcc[x];
+                                index[kept] = index[x];
+                                packedX[kept] = packedX[x];
+                                packedAcc[kept] = packedAcc[x];
+                                kept += 1 - done[x];
+                        }
+
+                        skipped += (active - kept) * (N - 1 - i);
+                        active = kept;
+                }
+
+                for (int x = 0; x < active; x++)
+                        acc[index[x]] = packedAcc[x];
+
+                return skipped;
+        }
+
+        template<int N>
+        void sumRow(const perlinOctave* octaves, const float* ampl, const float* xs, float y, float* out, int n,
+                    const Termination* termination, const float* start)
+        {
+                perlinOctave::RowState rows[N];
+                for (int i = 0; i < N; i++)
+                        rows[i] = octaves[i].prepareRow(y);
+
+                // Octaves whose cells span many pixels are stepped cell by cell across the whole
+                // row first, so their cells aren't cut up by the blocks. Not with a termination,
+                // its packed lists aren't evenly spaced once pixels are dropped.
+                bool coherent[N] = {};
+                if (!termination)
+                {
+                        if (!start)
+                                std::fill(out, out + n, 0.0f);
+                        else if (start != out)
+                                std::copy(start, start + n, out);
+
+                        float step = (n > 1 ? xs[1] - xs[0] : 0.0f);
+                        for (int i = 0; i < N; i++)
+                                if (octaves[i].coherentPays(step))
+                                {
+                                        perlinOctave::coherentKernel()(rows[i], xs, ampl[i], out, n);
+                                        coherent[i] = true;
+                                }
+                }
+
+                const perlinOctave::RowKernel accumulate = perlinOctave::accumulateKernel();
+
+                int skipped = 0;
+                for (int b = 0; b < n; b += blockSize)
+                {
+                        int count = std::min(blockSize, n - b);
+                        float* acc = out + b;
+
+                        if (termination)
+                                skipped += sumBlockTerminating<N>(rows, ampl, xs + b, acc, count, *termination, (start ? start + b : nullptr));
+                        else
+                                for (int i = 0; i < N; i++)
+                                        if (!coherent[i])
+                                                accumulate(rows[i], xs + b, ampl[i], acc, count);
+
+                        for (int x = 0; x < count; x++)
+                        {
+                                float v = acc[x] * 1.4f;
+                                acc[x] = (v > 1.0f ? 1.0f : (v < -1.0f ? -1.0f : v));
+                        }
+                }
+
+                if (termination && termination->counters)
+                {
+                        termination->counters->evaluated += uint64_t(n) * N - skipped;
+                        termination->counters->skipped += skipped;
+                }
+        }
+
+        template<int... I>
+        std::array<RowFunction, maxOctaves + 1> makeRowTable(std::integer_sequence<int, I...>)
+        {
+                return { { nullptr, &sumRow<I + 1>... } };
+        }
+
+        inline RowFunction rowFunction(int numOctaves)
+        {
+                static const std::array<RowFunction, maxOctaves + 1> table = makeRowTable(std::make_integer_sequence<int, maxOctaves>());
+
+                return table[numOctaves];
+        }
+
+        // the weights getValue uses: 1, 1/r, 1/r^2, ...
+        inline void amplitudes(float amplRatio, int numOctaves, float* ampl)
+        {
+                float a = 1.0f;
+                for (int i = 0; i < numOctaves; i++, a /= amplRatio)
+                        ampl[i] = a;
+        }
+}
@@ -0,0 +1,260 @@
+#pragma once
+#include "fusedOctaves.h"
+#include "multiRate.h"
+#include "threadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Final map values in tiles of a global pixel grid, so that panning back over a
+// part of the map or returning to an earlier zoom doesn't evaluate it again.
+// Global pixel (gx, gy) of a zoom level is the world point (gx, gy) / pixelsPerUnit,
+// tiles are tileSize x tileSize blocks of that grid. The config key has to change
+// with everything that changes the values (seed, octaves, angles, amplRatio, zoom).
+class HeightTileCache
+{
+public:
+        static constexpr int tileSize = 64;
+        static constexpr size_t tileBytes = tileSize * tileSize * sizeof(float);
+
+        size_t budgetBytes = size_t(64) << 20; // 0 turns the cache off
+
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+
+        bool enabled() const { return budgetBytes >= tileBytes; }
+
+        size_t bytesUsed() const { return tiles.size() * tileBytes; }
+
+        void clear()
+        {
+                tiles.clear();
+                order.clear();
+        }
+
+        // Limits an assemble to the missing tiles closest to a focus pixel that can be
+        // evaluated before a deadline, so a view can be shown while it's still filling in.
+        struct Refinement
+        {
+                int focusX, focusY; // global pixel
+                std::chrono::steady_clock::time_point deadline; // no tile is started after it (except each thread's first)
+        };
+
+        // Writes the width x height values whose top left pixel is the global pixel
+        // (originX, originY) into out, evaluating only the tiles that aren't cached
+        // (in parallel on pool). Tiles cut off by refinement's deadline are left out
+        // of out, whatever it held there stays. Returns how many tiles of the view are
+        // still missing, or -1, with out incomplete, if cancelled got set. A termination
+        // and a multi-rate plan change the values, so they have to be part of config; the
+        // termination is the one of the octaves after the plan's coarse ones. The rows of
+        // out are copied in parallel, assembled is called with each one once it's complete.
+        int assemble(uint64_t config, const perlinOctave* octaves, const float* ampl, int numOctaves, float pixelsPerUnit,
+                     int originX, int originY, float* out, int width, int height, ThreadPool& pool,
+                     const std::atomic<bool>* cancelled = nullptr, const Refinement* refinement = nullptr,
+                     const fused::Termination* termination = nullptr, const multirate::Plan* plan = nullptr,
+                     const std::function<void(int row)>* assembled = nullptr)
+        {
+                int firstX = floorDiv(originX), lastX = floorDiv(originX + width - 1);
+                int firstY = floorDiv(originY), lastY = floorDiv(originY + height - 1);
+
+                assembly++;
+
+                std::vector<Key> missing;
+                for(int ty = firstY; ty <= lastY; ty++)
+                        for(int tx = firstX; tx <= lastX; tx++)
+                        {
+                                Key key = { config, tx, ty };
+                                Tile& tile = get(key);
+                                if(tile.values.empty())
+                                {
+                                        tile.values.resize(tileSize * tileSize);
+                                        missing.push_back(key);
+                                }
+                        }
+
+                if(refinement)
+                        std::sort(missing.begin(), missing.end(), [&](const Key& a, const Key& b)
+                        {
+                                return focusDistance(a, *refinement) < focusDistance(b, *refinement);
+                        });
+
+                std::vector<float*> missingValues;
+                for(const Key& key : missing)
+                        missingValues.push_back(tiles.find(key)->second.values.data());
+
+                std::vector<char> evaluated(missing.size(), 0);
+                pool.run((int)missing.size(), [&](int begin, int end)
+                {
+                        for(int i = begin; i < end && !(cancelled && *cancelled); i++)
+                        {
+                                if(refinement && i > begin && std::chrono::steady_clock::now() > refinement->deadline)
+                                        break;
+
+                                evaluate(missing[i], octaves, ampl, numOctaves, pixelsPerUnit, missingValues[i], termination, plan);
+                                evaluated[i] = 1;
+                        }
+                });
+
+                int left = 0;
+                for(size_t i = 0; i < missing.size(); i++)
+                        if(!evaluated[i])
+                        {
+                                erase(missing[i]);
+                                left++;
+                        }
+
+                if(cancelled && *cancelled)
+                        return -1;
+
+                // the tiles in view, null where one is missing
+                int columns = lastX - firstX + 1;
+                std::vector<const float*> inView((size_t)columns * (lastY - firstY + 1), nullptr);
+                for(int ty = firstY; ty <= lastY; ty++)
+                        for(int tx = firstX; tx <= lastX; tx++)
+                        {
+                                auto found = tiles.find({ config, tx, ty });
+                                if(found != tiles.end())
+                                        inView[(ty - firstY) * columns + (tx - firstX)] = found->second.values.data();
+                        }
+
+                pool.run(height, [&](int begin, int end)
+                {
+                        for(int row = begin; row < end; row++)
+                        {
+                                int y = originY + row;
+                                int ty = floorDiv(y);
+                                for(int tx = firstX; tx <= lastX; tx++)
+                                {
+                                        const float* tile = inView[(ty - firstY) * columns + (tx - firstX)];
+                                        if(!tile)
+                                                continue;
+
+                                        // the part of the tile that is in view, in global pixels
+                                        int x0 = std::max(tx * tileSize, originX), x1 = std::min((tx + 1) * tileSize, originX + width);
+                                        std::memcpy(&out[row * width + (x0 - originX)], &tile[(y - ty * tileSize) * tileSize + (x0 - tx * tileSize)],
+                                                    (x1 - x0) * sizeof(float));
+                                }
+
+                                if(assembled)
+                                        (*assembled)(row);
+                        }
+                });
+
+                return left;
+        }
+
+        // how many tiles of the view aren't cached
+        int missingTiles(uint64_t config, int originX, int originY, int width, int height) const
+        {
+                int count = 0;
+                for(int ty = floorDiv(originY); ty <= floorDiv(originY + height - 1); ty++)
+                        for(int tx = floorDiv(originX); tx <= floorDiv(originX + width - 1); tx++)
+                                count += (tiles.find({ config, tx, ty }) == tiles.end());
+                return count;
+        }
+
+        // FNV-1a, used to fold the map config into one key
+        static uint64_t hashBytes(const void* data, size_t size, uint64_t h = 0xCBF29CE484222325ull)
+        {
+                const unsigned char* bytes = (const unsigned char*)data;
+                for(size_t i = 0; i < size; i++)
+                        h = (h ^ bytes[i]) * 0x100000001B3ull;
+                return h;
+        }
+
+private:
+        struct Key
+        {
+                uint64_t config;
+                int tx, ty;
+
+                bool operator==(const Key& o) const { return config == o.config && tx == o.tx && ty == o.ty; }
+        };
+
+        struct KeyHash
+        {
+                size_t operator()(const Key& k) const { return size_t(k.config ^ (uint64_t(uint32_t(k.tx)) * 0x9E3779B97F4A7C15ull) ^ (uint64_t(uint32_t(k.ty)) << 32)); }
+        };
+
+        struct Tile
+        {
+                std::vector<float> values; // empty until evaluated
+                std::list<Key>::iterator use; // position in order
+                uint64_t assembly; // the last assemble that used it
+        };
+
+        std::unordered_map<Key, Tile, KeyHash> tiles;
+        std::list<Key> order; // most recently used first
+        uint64_t assembly = 0;
+
+        static long long focusDistance(const Key& key, const Refinement& refinement)
+        {
+                long long dx = key.tx * tileSize + tileSize / 2 - refinement.focusX;
+                long long dy = key.ty * tileSize + tileSize / 2 - refinement.focusY;
+                return dx * dx + dy * dy;
+        }
+
+        static int floorDiv(int a) { return (a >= 0 ? a / tileSize : -((-a + tileSize - 1) / tileSize)); }
+
+        // the cached tile, or a new empty one. Tiles of the current assemble are
+        // never evicted, so a view bigger than the budget goes over it for a while.
+        Tile& get(const Key& key)
+        {
+                auto found = tiles.find(key);
+                if(found != tiles.end())
+                {
+                        hits++;
+                        order.splice(order.begin(), order, found->second.use);
+                        found->second.assembly = assembly;
+                        return found->second;
+                }
+
+                misses++;
+
+                while(!order.empty() && bytesUsed() + tileBytes > budgetBytes)
+                {
+                        auto oldest = tiles.find(order.back());
+                        if(oldest->second.assembly == assembly)
+                                break;
+
+                        tiles.erase(oldest);
+                        order.pop_back();
+                }
+
+                order.push_front(key);
+                Tile& tile = tiles[key];
+                tile.use = order.begin();
+                tile.assembly = assembly;
+                return tile;
+        }
+
+        void erase(const Key& key)
+        {
+                auto found = tiles.find(key);
+                order.erase(found->second.use);
+                tiles.erase(found);
+        }
+
+        static void evaluate(const Key& key, const perlinOctave* octaves, const float* ampl, int numOctaves, float pixelsPerUnit, float* out,
+                             const fused::Termination* termination, const multirate::Plan* plan)
+        {
+                float xs[tileSize];
+                for(int i = 0; i < tileSize; i++)
+                        xs[i] = perlinOctave::wrapCoord(float(key.tx * tileSize + i) / pixelsPerUnit);
+
+                int coarse = (plan ? plan->coarseOctaves : 0);
+                if(coarse > 0)
+                        multirate::coarseSums(*plan, octaves, ampl, pixelsPerUnit, 0.0, 0.0, key.tx * tileSize, key.ty * tileSize, out, tileSize, tileSize);
+
+                fused::RowFunction sumRow = fused::rowFunction(numOctaves - coarse);
+                for(int j = 0; j < tileSize; j++)
+                        sumRow(octaves + coarse, ampl + coarse, xs, float(key.ty * tileSize + j) / pixelsPerUnit, &out[j * tileSize], tileSize,
+                               termination, (coarse > 0 ? &out[j * tileSize] : nullptr));
+        }
+};
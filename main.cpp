@@ -4,8 +4,15 @@
 #define PGEWS_APPLICATION
 #include "PGEwindowsim.h"
 #include "perlinOctave.h"
+#include "fusedOctaves.h"
+#include "octaveLayers.h"
+#include "heightTiles.h"
+#include "multiRate.h"
+#include "threadPool.h"
+#include "backgroundJob.h"
 #include "TransformedViewWindow.h"
 #include "HeightMap.h"
+#include <cstring>
 
 enum win_ids
 {
@@ -35,12 +42,19 @@ public:
                         "W to increase the water level\n\n"
                         "S to toggle changing slice limits\n\n"
                         "LMB and RMB for changing slice limits\n\n"
-                        "UP to increase the number of octaves (up to 10)\n\n"
+                        "UP to increase the number of octaves (up to 10, 20 hashed)\n\n"
                         "DOWN to decrease the number of octaves\n\n"
                         "Space to generate a new map with a new seed\n\n"
+                        "G to toggle hashed gradients\n\n"
+                        "P to toggle progressive rendering\n\n"
+                        "L to toggle skipping octaves finer than a pixel\n\n"
+                        "T to toggle stopping octaves once the color is known\n\n"
+                        "H to toggle coloring through a height palette\n\n"
+                        "K to toggle the height tile cache\n\n"
+                        "N to add an evaluation thread\n\n"
                         "I to toggle the map info window\n\n"
                         "CTRL+I to toggle this window\n\n"
-                        "For A, R and W you can use shift for decreasing\n\n");
+                        "For A, R, W and N you can use shift for decreasing\n\n");
 
                 return true;
         }
@@ -83,6 +97,9 @@ private:
 
 	std::vector<perlinOctave> octaves;
         const int max_octaves = 10;
+        const int max_hashed_octaves = fused::maxOctaves;
+
+        bool hashedGradients = false; // hashed octaves have no lattice, so they can go much higher
 
 	olc::Sprite screenshot;
 
@@ -97,6 +114,16 @@ private:
 public:
         TransformedViewWindow tvw;
 
+        struct GenerationStats
+        {
+                uint64_t tileHits = 0;
+                uint64_t tileMisses = 0;
+                size_t tileBytes = 0;
+                std::vector<double> bandTimes; // per thread, of the last parallel run
+                uint64_t octaveSamples = 0;    // evaluated by the row functions
+                uint64_t octavesSkipped = 0;   // left out by early termination
+        };
+
 public:
         bool wOnUserCreate() override
         {
@@ -108,16 +135,24 @@ public:
                         "W to increase the water level\n"
                         "S to toggle changing slice limits\n"
                         "S + CTRL to get the seed of this map\n"
-                        "UP to increase the number of octaves (up to " << max_octaves << ")\n"
+                        "UP to increase the number of octaves (up to " << max_octaves << ", " << max_hashed_octaves << " with hashed gradients)\n"
                         "DOWN to decrease the number of octaves\n"
                         "Space to generate a new map with a new seed\n"
+                        "G to toggle hashed gradients\n"
+                        "P to toggle progressive rendering\n"
+                        "L to toggle skipping octaves finer than a pixel\n"
+                        "T to toggle stopping octaves once the color is known\n"
+                        "H to toggle coloring through a height palette\n"
+                        "K to toggle the height tile cache\n"
+                        "N to add an evaluation thread\n"
                         "F12 to save the current map\n"
-                        "For A, R and W you can use shift for decreasing\n";
+                        "For A, R, W and N you can use shift for decreasing\n";
 
 		seed = time(nullptr);
 		srand(seed);
 
                 std::cout << "\n" << "seed: " << seed << "\n";
+                std::cout << "noise kernel: " << perlinOctave::rowKernelName() << "\n";
 
 		tvw.init(this, 0.10f);
 
@@ -126,12 +161,11 @@ public:
 		octaves.resize(numOctaves);
 		for (int i = 0, freq = 4; i < numOctaves; i++, freq *= 2)
 		{
-			octaves[i].init(freq);
+			initOctave(i, freq);
 		}
 
-		setValues();
-
-                draw();
+                invalidate(windowResized);
+                render();
 
 		return true;
         }
@@ -139,34 +173,662 @@ public:
 private:
 	int numOctaves = 5;
 
+        int maxOctaves() { return hashedGradients ? max_hashed_octaves : max_octaves; }
+
+        void initOctave(int i, int freq)
+        {
+                layers.invalidate(i);
+                gradientGeneration++;
+
+                if(hashedGradients)
+                        octaves[i].initHashed(freq, (uint32_t)seed, i);
+                else
+                        octaves[i].init(freq);
+        }
+
 	float amplRatio = 2.0f;
 
-	void setValues()
-	{
-//                float valueScaling = getValueScaling();
-//                scale = 1.0f;
-//                if(pge->GetKey(olc::Key::D).bHeld)
-//                        std::cout << "VS perlin: " << scale << "\n";
+        // Level of detail: an octave whose lattice has more than maxCellsPerPixel cells
+        // per screen pixel can't be resolved and only adds aliasing, so when zoomed out
+        // the map is the sum of the coarser octaves. Noise octaves average to 0, so
+        // leaving them out is the same as replacing them with their expected value.
+        bool octaveCulling = true;
+        float maxCellsPerPixel = 0.5f;
+
+        // how many octaves, from the first, are summed at this zoom
+        int visibleOctaves(float pixelsPerUnit)
+        {
+                if(!octaveCulling)
+                        return numOctaves;
+
+                int count = 1;
+                while(count < numOctaves && octaves[count].freq <= maxCellsPerPixel * pixelsPerUnit)
+                        count++;
+                return count;
+        }
+
+        // Early termination: a pixel's remaining octaves are skipped once they can't change
+        // its color, see fused::Termination. Only values beyond +-1 are decided for the
+        // default (linear) gradients; none and abrupt segments make more of them flat.
+        // Off by default, the checks cost about as much as the octaves they save unless
+        // there are many octaves and flat segments.
+        bool earlyTermination = false;
+        fused::Counters octaveCounters;
+
+        // Multi-rate: the low octaves that a spline through samples every few pixels gets
+        // within multiRateTolerance of are reconstructed that way, see multirate::plan
+        bool multiRate = true;
+        float multiRateTolerance = 0.002f; // about half a color step of the gradients
+
+        // Periodic views: perlin wraps x and y, so the map repeats every world unit. Once the
+        // view spans more than one period only its first period is evaluated and the rest
+        // is copied. The scale is snapped so that a period is a whole number of pixels, then
+        // every pixel repeats the one a period left of or above it. At a few pixels per period
+        // rounding could undo a zoom step, so the snap goes the way the view was zoomed.
+        bool periodicViews = true;
+        int snappedPeriod = 0; // pixels per period the scale was last snapped to, 0 if it wasn't
+
+        // snaps the scale if the view spans more than one period and gives the part of it
+        // to evaluate: all of it, or one period along the axes it spans more than one of
+        olc::vi2d periodRegion()
+        {
+                float ppu = tvw.pixelsPerUnit();
+                if(!periodicViews || ppu < 1.0f || (ppu >= WindowWidth() && ppu >= WindowHeight()))
+                {
+                        snappedPeriod = 0;
+                        return { WindowWidth(), WindowHeight() };
+                }
 
-                float maximum = 1.0f;
+                int period = (int)std::round(ppu);
+                if(snappedPeriod > 0 && std::abs(ppu - snappedPeriod) < 0.001f)
+                        period = snappedPeriod;
+                else if(snappedPeriod > 0)
+                        period = (int)(ppu < snappedPeriod ? std::floor(ppu) : std::ceil(ppu));
+                period = std::max(period, 1);
+                snappedPeriod = period;
+
+                // about the point handleZooming zooms about, so wheel zooms stay under the cursor
+                olc::vi2d anchor = (lMouseInBounds() ? lGetMousePos() : olc::vi2d(WindowWidth() / 2, WindowHeight() / 2));
+                tvw.setScale(float(period) / tvw.pixelsPerUnit(1.0f), anchor);
+                return { std::min(WindowWidth(), period), std::min(WindowHeight(), period) };
+        }
+
+        // repeats the top left periodWidth x periodHeight block of a width x height image over all of it
+        template<typename T>
+        static void repeatPeriod(T* data, int width, int height, int periodWidth, int periodHeight)
+        {
+                for(int y = 0; y < height; y++)
+                {
+                        T* row = &data[y * width];
+                        if(y >= periodHeight)
+                        {
+                                std::copy(row - periodHeight * width, row - periodHeight * width + width, row);
+                                continue;
+                        }
 
+                        for(int x = periodWidth; x < width; x += periodWidth)
+                                std::copy(row, row + std::min(periodWidth, width - x), row + x);
+                }
+        }
+
+        // evaluates rows (or tiles) of the map in parallel, the calling thread included
+        ThreadPool workers;
+
+	std::vector<float> rowX;
+	std::vector<float> rowY;
+
+	// PixelToWorld is separable, so one row of wrapped x positions serves every row
+	void setRowCoordinates()
+	{
+		rowX.resize(WindowWidth());
+		for (int x = 0; x < WindowWidth(); x++)
+			rowX[x] = perlinOctave::wrapCoord(tvw.PixelToWorld({ x,0 }).x);
+
+		rowY.resize(WindowHeight());
 		for (int y = 0; y < WindowHeight(); y++)
-			for (int x = 0; x < WindowWidth(); x++)
-			{
-//				olc::vf2d worldPos = {float(x)/GetWindowWidth(), float(y)/GetWindowHeight()};
-                                olc::vf2d worldPos = tvw.PixelToWorld({ x,y });
+			rowY[y] = tvw.PixelToWorld({ 0,y }).y;
+	}
+
+        struct MapView
+        {
+                float scale;
+                olc::vf2d offset;
+                int width, height;
 
-				int index = y * WindowWidth() + x;
+                bool operator==(const MapView& o) const { return scale == o.scale && offset == o.offset && width == o.width && height == o.height; }
+                bool operator!=(const MapView& o) const { return !(*this == o); }
+        };
 
-                                values[index] = getValue(worldPos);
+        MapView currentView() { return { tvw.getScale(), tvw.getOffset(), WindowWidth(), WindowHeight() }; }
 
-				if (values[index] > 1.0f)
-					values[index] = 1.0f;
-				if (values[index] < -1.0f)
-					values[index] = -1.0f;
-			}
+        // raw noise of every octave for layerView, so that amplitude ratio, octave
+        // count and angle offset changes are a blend instead of a re-evaluation
+        OctaveLayerCache layers;
+        MapView layerView = {};
+
+        bool anglesChanged = false; // the next evaluation should keep perpendicular bases
+        bool fullReevaluation = true; // something besides the view offset changed since the last evaluation
+
+        // The values are generated on a background job into backValues while the window
+        // keeps showing values (of renderedView). Everything the job needs from the UI
+        // side is captured here when it starts; state it reads directly (octaves, the
+        // caches, rowX/rowY, values) is only changed after cancelling it, see invalidate.
+        struct Job
+        {
+                enum Path { full, fromLayers, fromTiles, shifted } path;
+                MapView view;
+                olc::vi2d region;      // the part of the view evaluated, see periodRegion
+                int numOctaves;
+                float ampl[fused::maxOctaves];
+                bool basis;            // fromLayers: keep perpendicular bases
+                float pixelsPerUnit;
+                uint64_t tileConfig;   // fromTiles
+                olc::vi2d origin;      // fromTiles: global pixel of the top left corner
+                olc::vi2d shift;       // shifted: pixels the view moved since renderedView
+                int step;              // > 1: a preview pass at every step-th pixel, 1: the exact values of path
+                bool refinesPrevious;  // preview pass: the samples of a pass at twice the step are already there
+                bool previewed;        // the exact pass can keep the samples of the step 2 pass (not with a multi-rate plan)
+                bool interactive;      // a reduced resolution preview while the view is dragged, nothing follows it
+                bool refine;           // fromTiles: evaluate the tiles closest to focus first, until the frame budget runs out
+                olc::vi2d focus;       // view pixel refinement starts at
+                long long samples;     // octave samples this pass evaluates
+                multirate::Plan plan;  // full and fromTiles: the octaves reconstructed from coarse samples
+                bool terminates;       // the row functions get termination
+                fused::Termination termination;     // of all octaves
+                fused::Termination fineTermination; // of the octaves after the plan's coarse ones
+                std::shared_ptr<const std::vector<olc::Pixel>> palette; // if set, the region is colored into backImage too
+        };
+
+        Job generating;
+        std::vector<float> backValues;
+        std::vector<olc::Pixel> backImage;    // the colors of backValues, if the job has a palette
+        std::vector<olc::Pixel> arrivedImage; // the colors of the last finished job, until draw() takes them
+        std::shared_ptr<const std::vector<olc::Pixel>> arrivedPalette; // that they're colored with
+        std::vector<float> periodValues; // the region of a periodic view, before it's repeated into backValues
+        MapView requestedView = {}; // the view of the last job started
+        bool renderedExact = false; // values aren't a preview or partially refined
+        bool refinePending = false; // generating isn't exact yet, the next pass of it has to be started
+        int tilesLeft = 0;          // missing tiles after the last refining pass (written by the job)
+
+        // Progressive mode: evaluations above progressiveSamples octave samples are first
+        // shown at every 8th pixel, then every 4th and 2nd, each pass a job of its own,
+        // so something is shown after about 1/64 of the work. The exact pass then fills
+        // in tiles around the mouse (or the view centre) first, a frame budget at a time.
+        bool progressive = true;
+        long long progressiveSamples = 4000000;
+        const int coarsestStep = 8;
+        int refineBudgetMs = 12;
+
+        // Adaptive resolution: while the view is being panned or zoomed, evaluations that
+        // would take longer than frameBudgetMs are done as a single preview pass at the
+        // step that fits the budget, and the exact values follow once the input settles
+        // for settleTime. The cost of a sample is measured from finished jobs.
+        bool adaptiveResolution = true;
+        float frameBudgetMs = 16.0f;
+        float settleTime = 0.15f;
+        const int maxInteractiveStep = 8;
+        double msPerSample = 5e-6;     // running estimate
+        double jobMs = 0.0;            // how long the last job took (written by the job)
+        float sinceInteraction = 1.0f; // seconds
+        bool settlePending = false;    // an interactive preview was started, the exact values have to follow
+
+        bool interacting()
+        {
+                return adaptiveResolution && sinceInteraction < settleTime;
+        }
+
+        // the step at which a preview of the view fits the frame budget, 1 if the exact pass does
+        int interactiveStep(const Job& next)
+        {
+                if(evaluationCost(next) * msPerSample <= frameBudgetMs)
+                        return 1;
+
+                double fullMs = double(next.region.x) * next.region.y * next.numOctaves * msPerSample;
+                int step = (int)std::ceil(std::sqrt(fullMs / frameBudgetMs));
+                return std::max(2, std::min(step, maxInteractiveStep));
+        }
+
+        // octave samples the pass of job evaluates, for measuring their cost (UI thread)
+        long long passSamples(const Job& job)
+        {
+                if(job.step == 1)
+                        return evaluationCost(job);
+
+                long long samples = (long long)((job.region.x + job.step - 1) / job.step) * ((job.region.y + job.step - 1) / job.step) * job.numOctaves;
+                return (job.refinesPrevious ? samples * 3 / 4 : samples);
+        }
+
+        // picks how to get the values of the current view and snaps the view for it (UI thread)
+        Job prepareValues()
+        {
+                Job next;
+                next.region = periodRegion();
+                next.numOctaves = visibleOctaves(tvw.pixelsPerUnit());
+                fused::amplitudes(amplRatio, next.numOctaves, next.ampl);
+                next.basis = anglesChanged;
+                next.path = Job::full;
+
+                next.plan = (multiRate ? multirate::plan(octaves.data(), next.ampl, next.numOctaves, tvw.pixelsPerUnit(), multiRateTolerance) : multirate::Plan());
+
+                std::vector<std::pair<float, float>> flat;
+                flatRanges(flat);
+                int coarse = next.plan.coarseOctaves;
+                next.terminates = earlyTermination;
+                next.termination.prepare(next.ampl, next.numOctaves, flat);
+                next.termination.counters = &octaveCounters;
+                next.fineTermination.prepare(next.ampl + coarse, next.numOctaves - coarse, flat);
+                next.fineTermination.counters = &octaveCounters;
+
+                // while the view keeps changing (panning, zooming) the layers would be
+                // thrown away every frame, so they are only used once it stays put
+                MapView view = currentView();
+                bool viewStable = (view == layerView);
+                if(!viewStable)
+                {
+                        layers.invalidate();
+                        layerView = view;
+                }
+
+                bool repeated = (next.region != olc::vi2d(WindowWidth(), WindowHeight()));
+
+                if(viewStable && layers.fits(next.numOctaves, next.region.x * next.region.y, anglesChanged))
+                        next.path = Job::fromLayers;
+                else if(tiles.enabled())
+                {
+                        next.path = Job::fromTiles;
+                        next.tileConfig = tileConfig();
+                        next.origin = snapToTiles();
+                }
+                else if(!fullReevaluation && !repeated && pixelShift(next.shift))
+                        next.path = Job::shifted;
+
+                setRowCoordinates();
+                backValues.resize(WindowWidth() * WindowHeight());
+                if(repeated)
+                        periodValues.resize(next.region.x * next.region.y);
+
+                next.view = currentView();
+                next.pixelsPerUnit = tvw.pixelsPerUnit();
+                requestedView = next.view;
+
+                bool slow = progressive && evaluationCost(next) > progressiveSamples;
+                next.step = (slow ? coarsestStep : 1);
+                next.refinesPrevious = false;
+                next.previewed = false;
+                next.refine = slow;
+                next.interactive = false;
+
+                if(interacting())
+                {
+                        int step = interactiveStep(next);
+                        if(step > 1)
+                        {
+                                next.step = step;
+                                next.interactive = true;
+                                settlePending = true;
+                        }
+                }
+                next.focus = (lMouseInBounds() ? lGetMousePos() : olc::vi2d(WindowWidth() / 2, WindowHeight() / 2));
+
+                // the gradients are only turned to new angle offsets here, when something
+                // besides blending layers with a basis is going to read them
+                if(next.path != Job::fromLayers || !next.basis || next.step > 1)
+                {
+                        for(int i = 0; i < next.numOctaves; i++)
+                                octaves[i].updateGradientVectors();
+                }
+
+                return next;
+        }
+
+        // how many octave samples the exact pass of next evaluates (UI thread)
+        long long evaluationCost(const Job& next)
+        {
+                long long pixels = (long long)next.region.x * next.region.y;
+
+                // the spline of the plan's coarse octaves costs about as much as one octave
+                int coarse = next.plan.coarseOctaves;
+                int perPixel = next.numOctaves - coarse + (coarse > 0 ? 1 : 0);
+
+                switch(next.path)
+                {
+                        case Job::full:
+                                return pixels * perPixel;
+                        case Job::fromLayers:
+                        {
+                                long long cost = 0;
+                                for(int i = 0; i < next.numOctaves; i++)
+                                        if(i >= layers.size() || !layers[i].usable(octaves[i].angleOffset))
+                                                cost += pixels * (next.basis ? 2 : 1);
+                                return cost;
+                        }
+                        case Job::fromTiles:
+                                return (long long)tiles.missingTiles(next.tileConfig, next.origin.x, next.origin.y, next.region.x, next.region.y)
+                                        * HeightTileCache::tileSize * HeightTileCache::tileSize * perPixel;
+                        default:
+                                return 0;
+                }
+        }
+
+        // One pass of progressive refinement: the exact value at every step-th pixel, each
+        // filling the step x step block below and right of it. The samples of the previous,
+        // twice as coarse pass are already in out.
+        bool previewPass(const Job& job, float* out, const std::atomic<bool>& cancelled)
+        {
+                int width = job.region.x;
+                int height = job.region.y;
+                int step = job.step;
+
+		fused::RowFunction sumRow = fused::rowFunction(job.numOctaves);
+
+                workers.run((height + step - 1) / step, [&](int begin, int end)
+                {
+                        std::vector<float> xs, samples;
+
+                        for(int by = begin; by < end && !cancelled; by++)
+                        {
+                                int y = by * step;
+                                float* row = &out[y * width];
+
+                                // rows of the previous pass only have every other sample missing
+                                bool oldRow = (job.refinesPrevious && y % (2 * step) == 0);
+                                int first = (oldRow ? step : 0);
+                                int stride = (oldRow ? 2 * step : step);
+
+                                xs.clear();
+                                for(int x = first; x < width; x += stride)
+                                        xs.push_back(rowX[x]);
+
+                                samples.resize(xs.size());
+                                if(!xs.empty())
+                                        sumRow(octaves.data(), job.ampl, xs.data(), rowY[y], samples.data(), (int)xs.size(), termination(job), nullptr);
+
+                                for(size_t i = 0; i < xs.size(); i++)
+                                        row[first + i * stride] = samples[i];
+
+                                for(int x = 0; x < width; x += step)
+                                        std::fill(row + x + 1, row + std::min(x + step, width), row[x]);
+
+                                for(int y1 = y + 1; y1 < std::min(y + step, height); y1++)
+                                        std::memcpy(&out[y1 * width], row, width * sizeof(float));
+                        }
+                });
+
+                return !cancelled;
+        }
+
+        // fine: for the octaves after the coarse ones of job's multi-rate plan
+        const fused::Termination* termination(const Job& job, bool fine = false)
+        {
+                if(!job.terminates)
+                        return nullptr;
+                return (fine ? &job.fineTermination : &job.termination);
+        }
+
+        // writes the values of job into out (and their colors into backImage, if it has a
+        // palette), returns false if it got cancelled midway (any thread)
+        bool generateValues(const Job& job, float* out, const std::atomic<bool>& cancelled)
+        {
+                int width = job.view.width;
+                int height = job.view.height;
+                if(job.palette)
+                        backImage.resize(width * height);
+
+                // the passes of a periodic view build on periodValues, out gets a copy of it repeated
+                bool periodic = (job.region != olc::vi2d(width, height));
+                float* region = (periodic ? periodValues.data() : out);
+                if(!evaluateRegion(job, region, cancelled))
+                        return false;
+
+                if(job.palette && !colorsWhileEvaluating(job))
+                        workers.run(job.region.y, [&](int begin, int end)
+                        {
+                                colorPixels(job, region, begin * job.region.x, (end - begin) * job.region.x);
+                        });
+
+                if(!periodic)
+                        return true;
+
+                for(int y = 0; y < job.region.y; y++)
+                        std::memcpy(&out[y * width], &periodValues[y * job.region.x], job.region.x * sizeof(float));
+                repeatPeriod(out, width, height, job.region.x, job.region.y);
+                if(job.palette)
+                        repeatPeriod(backImage.data(), width, height, job.region.x, job.region.y);
+                return true;
+        }
+
+        // the exact passes color each row (or chunk of the layer blend) right after it's
+        // evaluated, while it's still in cache; the previews are colored once they're done
+        static bool colorsWhileEvaluating(const Job& job) { return job.palette && job.step == 1; }
+
+        // colors the pixels first .. first + count - 1 of job's region (in region, with the
+        // region's width as the row stride) into backImage
+        void colorPixels(const Job& job, const float* region, int first, int count)
+        {
+                int width = job.region.x;
+                for(int p = first; p < first + count; )
+                {
+                        int y = p / width, x = p % width;
+                        int n = std::min(width - x, first + count - p);
+                        colorRow(*job.palette, &region[p], &backImage[y * job.view.width + x], n);
+                        p += n;
+                }
+        }
+
+        // the values of job's region, with the region's width as the row stride
+        bool evaluateRegion(const Job& job, float* out, const std::atomic<bool>& cancelled)
+        {
+                int width = job.region.x;
+                int height = job.region.y;
+
+                tilesLeft = 0;
+
+                if(job.step > 1)
+                        return previewPass(job, out, cancelled);
+
+                if(job.path == Job::fromLayers)
+                        return setValuesFromLayers(job, out, cancelled);
+
+                if(job.path == Job::fromTiles)
+                {
+                        HeightTileCache::Refinement refinement = { job.origin.x + job.focus.x, job.origin.y + job.focus.y,
+                                                                   std::chrono::steady_clock::now() + std::chrono::milliseconds(refineBudgetMs) };
+
+                        std::function<void(int)> assembled = [&](int row) { colorPixels(job, out, row * width, width); };
+                        tilesLeft = tiles.assemble(job.tileConfig, octaves.data(), job.ampl, job.numOctaves, job.pixelsPerUnit,
+                                                   job.origin.x, job.origin.y, out, width, height, workers, &cancelled,
+                                                   (job.refine ? &refinement : nullptr), termination(job, true), &job.plan,
+                                                   (colorsWhileEvaluating(job) ? &assembled : nullptr));
+                        return tilesLeft >= 0;
+                }
+
+		fused::RowFunction sumRow = fused::rowFunction(job.numOctaves);
+
+                if(job.path == Job::shifted)
+                {
+                        setValuesShifted(sumRow, job, out, cancelled);
+                        return !cancelled;
+                }
+
+                // the coarse octaves of the plan are reconstructed for chunks of rows, the others summed per pixel on top
+                int coarse = job.plan.coarseOctaves;
+                fused::RowFunction fineRow = fused::rowFunction(job.numOctaves - coarse);
+                const int chunkRows = 32;
+
+                // the top left pixel of the view on the global pixel grid
+                double originX = double(job.view.offset.x) * job.pixelsPerUnit;
+                double originY = double(job.view.offset.y) * job.pixelsPerUnit;
+
+                workers.run(height, [&](int begin, int end)
+                {
+                        std::vector<float> xs, samples, sums, starts;
+
+                        for (int y0 = begin; y0 < end && !cancelled; y0 += chunkRows)
+                        {
+                                int rows = std::min(chunkRows, end - y0);
+                                if(coarse > 0)
+                                {
+                                        sums.resize(rows * width);
+                                        multirate::coarseSums(job.plan, octaves.data(), job.ampl, job.pixelsPerUnit, originX, originY, 0, y0, sums.data(), width, rows);
+                                }
+
+                                for (int y = y0; y < y0 + rows && !cancelled; y++)
+                                {
+                                        const float* start = (coarse > 0 ? &sums[(y - y0) * width] : nullptr);
+
+                                        if(!job.previewed || y % 2 != 0)
+                                                fineRow(octaves.data() + coarse, job.ampl + coarse, rowX.data(), rowY[y], &out[y * width], width, termination(job, true), start);
+                                        else
+                                        {
+                                                // the even pixels of even rows are samples of the preview
+                                                xs.clear();
+                                                starts.clear();
+                                                for (int x = 1; x < width; x += 2)
+                                                {
+                                                        xs.push_back(rowX[x]);
+                                                        if(start)
+                                                                starts.push_back(start[x]);
+                                                }
+
+                                                samples.resize(xs.size());
+                                                if(!xs.empty())
+                                                        fineRow(octaves.data() + coarse, job.ampl + coarse, xs.data(), rowY[y], samples.data(), (int)xs.size(),
+                                                                termination(job, true), (start ? starts.data() : nullptr));
+
+                                                for (size_t i = 0; i < xs.size(); i++)
+                                                        out[y * width + 1 + 2 * i] = samples[i];
+                                        }
+
+                                        if(colorsWhileEvaluating(job))
+                                                colorPixels(job, out, y * width, width);
+                                }
+                        }
+                });
+
+                return !cancelled;
 	}
 
+        // evaluated values of earlier views, so panning back or returning to a zoom is a copy.
+        // On by default, then every view change that can't blend the layers assembles tiles;
+        // with it off (K) pans shift the last values and everything else is evaluated in full.
+        HeightTileCache tiles;
+        const size_t tileBudgetBytes = tiles.budgetBytes; // what K turns it back on with
+        int gradientGeneration = 0; // lattice gradients depend on the rand() history, not just the seed
+
+        // everything the values depend on besides the position
+        uint64_t tileConfig()
+        {
+                int count = visibleOctaves(tvw.pixelsPerUnit());
+                struct { int seed, hashed, generation, octaves; float amplRatio, pixelsPerUnit, multiRateTolerance; } config =
+                        { seed, hashedGradients, (hashedGradients ? 0 : gradientGeneration), count, amplRatio, tvw.pixelsPerUnit(),
+                          (multiRate ? multiRateTolerance : 0.0f) };
+
+                uint64_t h = HeightTileCache::hashBytes(&config, sizeof(config));
+                for(int i = 0; i < count; i++)
+                        h = HeightTileCache::hashBytes(&octaves[i].angleOffset, sizeof(float), h);
+
+                // values stopped inside a flat range depend on the coloring
+                std::vector<std::pair<float, float>> flat;
+                flatRanges(flat);
+                if(!flat.empty())
+                        h = HeightTileCache::hashBytes(flat.data(), flat.size() * sizeof(flat[0]), h);
+                return h;
+        }
+
+        // snaps the offset onto the global pixel grid of this zoom, so the view lines
+        // up with the tiles, and gives the global pixel of the top left corner
+        olc::vi2d snapToTiles()
+        {
+                float ppu = tvw.pixelsPerUnit();
+                olc::vi2d origin = { (int)std::round(tvw.getOffset().x * ppu), (int)std::round(tvw.getOffset().y * ppu) };
+                tvw.setOffset(olc::vf2d(origin) / ppu);
+                layerView = currentView();
+                return origin;
+        }
+
+        // If the view only moved since the last evaluation, gives the whole pixel shift
+        // between them and snaps the offset onto the pixel grid of the old view, so the
+        // sub-pixel rest of a pan doesn't force a full evaluation.
+        bool pixelShift(olc::vi2d& shift)
+        {
+                MapView view = currentView();
+                if(!renderedExact || view.scale != renderedView.scale || view.width != renderedView.width || view.height != renderedView.height)
+                        return false;
+
+                olc::vf2d pixels = (view.offset - renderedView.offset) * tvw.pixelsPerUnit();
+                shift = { (int)std::round(pixels.x), (int)std::round(pixels.y) };
+
+                if(std::abs(shift.x) >= view.width || std::abs(shift.y) >= view.height)
+                        return false;
+
+                tvw.setOffset(renderedView.offset + olc::vf2d(shift) / tvw.pixelsPerUnit());
+                layerView = currentView();
+                return true;
+        }
+
+        // copies values moved by job.shift into out and evaluates only the rows and columns that came into view
+        void setValuesShifted(fused::RowFunction sumRow, const Job& job, float* out, const std::atomic<bool>& cancelled)
+        {
+                int width = job.view.width;
+                int height = job.view.height;
+                olc::vi2d shift = job.shift;
+
+                // the columns that stay in view, and where they come from
+                int keptWidth = width - std::abs(shift.x);
+                int destX = (shift.x < 0 ? -shift.x : 0);
+                int srcX = (shift.x > 0 ? shift.x : 0);
+
+                // exposed columns
+                int newX = (shift.x > 0 ? keptWidth : 0);
+                int newWidth = width - keptWidth;
+
+                workers.run(height, [&](int begin, int end)
+                {
+                        for(int y = begin; y < end && !cancelled; y++)
+                        {
+                                int srcY = y + shift.y;
+                                float* row = &out[y * width];
+
+                                if(srcY < 0 || srcY >= height)
+                                        sumRow(octaves.data(), job.ampl, rowX.data(), rowY[y], row, width, termination(job), nullptr);
+                                else
+                                {
+                                        std::memcpy(row + destX, &values[srcY * width + srcX], keptWidth * sizeof(float));
+
+                                        if(newWidth > 0)
+                                                sumRow(octaves.data(), job.ampl, rowX.data() + newX, rowY[y], row + newX, newWidth, termination(job), nullptr);
+                                }
+
+                                if(colorsWhileEvaluating(job))
+                                        colorPixels(job, out, y * width, width);
+                        }
+                });
+        }
+
+        // evaluates the layers that are missing (with the perpendicular basis if
+        // angle offsets are being changed) and blends all of them
+        bool setValuesFromLayers(const Job& job, float* out, const std::atomic<bool>& cancelled)
+        {
+                layers.resize(job.numOctaves);
+
+                float offsets[fused::maxOctaves];
+                for(int i = 0; i < job.numOctaves; i++)
+                {
+                        offsets[i] = octaves[i].angleOffset;
+                        if(!layers[i].usable(offsets[i]))
+                                layers[i].evaluate(octaves[i], rowX.data(), rowY.data(), job.region.x, job.region.y, job.basis, workers, &cancelled);
+
+                        if(cancelled)
+                                return false;
+                }
+
+                std::function<void(int, int)> blended = [&](int first, int count) { colorPixels(job, out, first, count); };
+                layers.blend(job.ampl, offsets, job.numOctaves, out, job.region.x * job.region.y, workers,
+                             (colorsWhileEvaluating(job) ? &blended : nullptr));
+                layers.evict(job.numOctaves);
+                return true;
+        }
+
 	float waterLevel = 0.0f;
 
 	void clamp(int& comp)
@@ -195,23 +857,176 @@ private:
         {
                 if(value <= waterLevel)
 //                        return water_grad.getColor((waterLevel >= 0.0f ? value : value - waterLevel));
-                        return water_grad.getColor(value - waterLevel);
+                        return water_grad.lookup(value - waterLevel);
                 else
-                        return land_grad.getColor(value);
+                        return land_grad.lookup(value);
+        }
+
+        // the open ranges of values heightMap gives one color for, empty without early termination
+        void flatRanges(std::vector<std::pair<float, float>>& ranges)
+        {
+                if(!earlyTermination)
+                        return;
+
+                std::vector<std::pair<float, float>> water, land;
+                water_grad.flatRanges(water);
+                land_grad.flatRanges(land);
+
+                for(const std::pair<float, float>& range : water)
+                        if(range.first + waterLevel < waterLevel)
+                                ranges.push_back({ range.first + waterLevel, std::min(range.second + waterLevel, waterLevel) });
+
+                for(const std::pair<float, float>& range : land)
+                        if(range.second > waterLevel)
+                                ranges.push_back({ std::max(range.first, waterLevel), range.second });
+        }
+
+        // the values of flat ranges are only good for the coloring they were evaluated with
+        bool valuesDependOnColors()
+        {
+                std::vector<std::pair<float, float>> flat;
+                flatRanges(flat);
+                return !flat.empty();
+        }
+
+        // the colored map without overlays, so the overlays can be redrawn without recoloring
+        std::unique_ptr<olc::Sprite> mapImage;
+
+        // Palette coloring: the values are quantized to 16 bit height indices once, and
+        // recoloring them (water level, interpolation methods) is a lookup in a palette
+        // of the colors of all 65536 heights, which is rebuilt from the gradients instead.
+        // The jobs color what they evaluate with it too, see Job::palette.
+        bool paletteColoring = true;
+        std::shared_ptr<const std::vector<olc::Pixel>> palette; // null until it's built for the current colors
+        std::vector<uint16_t> heightIndices; // of renderedRegion, with its width as the row stride
+        bool indicesCurrent = false;
+
+        static uint16_t heightIndex(float value)
+        {
+                return (uint16_t)((std::min(std::max(value, -1.0f), 1.0f) + 1.0f) * 32767.5f + 0.5f);
+        }
+
+        static float indexHeight(int index) { return float(index) / 32767.5f - 1.0f; }
+
+        // the palette of the current colors, built if they changed (UI thread)
+        std::shared_ptr<const std::vector<olc::Pixel>> currentPalette()
+        {
+                if(!palette)
+                {
+                        auto colors = std::make_shared<std::vector<olc::Pixel>>(65536);
+                        for(int i = 0; i < 65536; i++)
+                                (*colors)[i] = heightMap(indexHeight(i));
+                        palette = colors;
+                }
+                return palette;
+        }
+
+        static void colorRow(const std::vector<olc::Pixel>& palette, const float* values, olc::Pixel* out, int n)
+        {
+                for(int x = 0; x < n; x++)
+                        out[x] = palette[heightIndex(values[x])];
+        }
+
+        void quantizeValues()
+        {
+                heightIndices.resize(renderedRegion.x * renderedRegion.y);
+                for(int y = 0; y < renderedRegion.y; y++)
+                {
+                        const float* row = &values[y * renderedView.width];
+                        uint16_t* indices = &heightIndices[y * renderedRegion.x];
+                        for(int x = 0; x < renderedRegion.x; x++)
+                                indices[x] = heightIndex(row[x]);
+                }
+                indicesCurrent = true;
         }
 
 	void draw()
 	{
-		for(int y = 0; y < WindowHeight(); y++)
-			for (int x = 0; x < WindowWidth(); x++)
-			{
-				float value = getFromValuesArray(x,y);
+                // values may still be of the size before a resize, until the new ones are generated
+                int width = renderedView.width;
+                int height = renderedView.height;
 
-				//Draw({ x,y }, olc::PixelF(value, value, value));
-				pge->Draw({ x,y }, heightMap(value));
-			}
+                if(!mapImage || mapImage->width != width || mapImage->height != height)
+                        mapImage = std::make_unique<olc::Sprite>(width, height);
+
+                // the job's colors, if they're still the current ones
+                bool colored = (paletteColoring && arrivedPalette && arrivedPalette == palette);
+                arrivedPalette.reset();
+                if(colored)
+                {
+                        std::swap(mapImage->pColData, arrivedImage);
+                        reprojectedView = {};
+                        return;
+                }
+
+                // a periodic view is colored for one period and repeated like its values
+                if(paletteColoring)
+                {
+                        const std::vector<olc::Pixel>& colors = *currentPalette();
+                        if(!indicesCurrent)
+                                quantizeValues();
+
+                        for(int y = 0; y < renderedRegion.y; y++)
+                        {
+                                const uint16_t* indices = &heightIndices[y * renderedRegion.x];
+                                olc::Pixel* pixels = &mapImage->pColData[y * width];
+                                for(int x = 0; x < renderedRegion.x; x++)
+                                        pixels[x] = colors[indices[x]];
+                        }
+                }
+                else
+                {
+                        // rows are colored as land first and the water pixels redone
+                        for(int y = 0; y < renderedRegion.y; y++)
+                        {
+                                const float* row = &values[y * width];
+                                olc::Pixel* pixels = &mapImage->pColData[y * width];
+
+                                land_grad.getColors(row, pixels, renderedRegion.x);
+                                for (int x = 0; x < renderedRegion.x; x++)
+                                        if(row[x] <= waterLevel)
+                                                pixels[x] = water_grad.lookup(row[x] - waterLevel);
+                        }
+                }
+                repeatPeriod(mapImage->pColData.data(), width, height, renderedRegion.x, renderedRegion.y);
+
+                reprojectedView = {};
 	}
 
+        // the colored map resampled to a view it wasn't evaluated for, so a zoom or pan
+        // shows up right away while the values of the new view are being generated
+        std::unique_ptr<olc::Sprite> reprojectedImage;
+        MapView reprojectedView = {};
+
+        void reproject(const MapView& to)
+        {
+                const MapView& from = renderedView;
+                float fromPPU = tvw.pixelsPerUnit(from.scale);
+                float toPPU = tvw.pixelsPerUnit(to.scale);
+
+                // the transform is separable, so the source of every column and row is looked up once
+                std::vector<int> srcX(to.width), srcY(to.height);
+                for(int x = 0; x < to.width; x++)
+                {
+                        float old = ((x + 0.5f) / toPPU + to.offset.x - from.offset.x) * fromPPU;
+                        srcX[x] = (old >= 0.0f && old < from.width ? (int)old : -1);
+                }
+                for(int y = 0; y < to.height; y++)
+                {
+                        float old = ((y + 0.5f) / toPPU + to.offset.y - from.offset.y) * fromPPU;
+                        srcY[y] = (old >= 0.0f && old < from.height ? (int)old : -1);
+                }
+
+                if(!reprojectedImage || reprojectedImage->width != to.width || reprojectedImage->height != to.height)
+                        reprojectedImage = std::make_unique<olc::Sprite>(to.width, to.height);
+
+                for(int y = 0; y < to.height; y++)
+                        for(int x = 0; x < to.width; x++)
+                                reprojectedImage->SetPixel(x, y, (srcX[x] < 0 || srcY[y] < 0 ? olc::BLACK : mapImage->GetPixel(srcX[x], srcY[y])));
+
+                reprojectedView = to;
+        }
+
         void drawSlice()
         {
                 olc::vi2d startScreen = tvw.WorldToPixel(startSlice);
@@ -223,86 +1038,323 @@ private:
         }
 
 private:
-        bool redrawSignal = false;
-public:
-        void needToRedraw() { redrawSignal = true; }
+        // Every piece of map state invalidates the first stage that depends on it,
+        // render() then redoes that stage and everything after it:
+        //   reevaluate - noise values (a background job, recolors once it's done)
+        //   recolor    - values to colors (draw)
+        //   reblit     - colored map and overlays to the window
+        enum Stage { upToDate, reblit, recolor, reevaluate };
+
+        enum Change
+        {
+                seedChanged,      // new gradients for every octave
+                latticeChanged,   // lattice/hashed gradient source
+                octavesChanged,   // number of octaves
+                amplRatioChanged,
+                viewChanged,      // scale, offset or window size
+                windowResized,
+                gradientsChanged, // angle offsets
+                waterLevelChanged,
+                colorsChanged,    // gradient interpolation methods
+                overlayChanged    // slice line
+        };
+
+        Stage pending = upToDate; // of the stages after reevaluate
+        bool evaluationPending = true;
+        MapView renderedView = {};
+        olc::vi2d renderedRegion = {}; // of renderedView, the values outside of it repeat it
+
+        static Stage stageFor(Change change)
+        {
+                switch(change)
+                {
+                        case waterLevelChanged:
+                        case colorsChanged:
+                                return recolor;
+                        case overlayChanged:
+                                return reblit;
+                        default:
+                                return reevaluate;
+                }
+        }
 
-        void recalculateAndDraw()
+        // has to be called before changing the state, a running evaluation may still be reading it
+        void invalidate(Change change)
         {
-                setValues();
-                draw();
+                Stage stage = stageFor(change);
+                if(stage == recolor)
+                        palette.reset();
+                if(stage == recolor && valuesDependOnColors())
+                        stage = reevaluate;
+
+                if(stage == reevaluate)
+                {
+                        // while the view is dragged a running interactive preview (which fits
+                        // the frame budget) is let finish, so that something keeps arriving;
+                        // the next one starts from the latest view. Any other job is cancelled.
+                        if(change != viewChanged || !interacting() || !generating.interactive)
+                                cancelGeneration();
+                        evaluationPending = true;
+                        refinePending = false;
+                }
+
+                switch(change)
+                {
+                        case seedChanged:
+                        case latticeChanged:
+                                layers.invalidate();
+                                gradientGeneration++;
+                                break;
+                        case gradientsChanged:
+                                anglesChanged = true;
+                                break;
+                        default:
+                                break;
+                }
+
+                // a view change can be a pan, which setValues may do by shifting values
+                if(change != viewChanged && stage == reevaluate)
+                        fullReevaluation = true;
+
+                if(stage != reevaluate)
+                        pending = std::max(pending, stage);
+        }
+
+        // everything the info window shows about the last generated values, copied
+        // when they arrive since the caches and the pool belong to the job until then
+        GenerationStats stats;
+
+        void cancelGeneration()
+        {
+                if(generator.cancel())
+                        evaluationPending = true;
+        }
+
+        // makes the generated values the shown ones, and moves a progressive evaluation on to its next pass
+        void finishGeneration()
+        {
+                renderedView = generating.view;
+                renderedRegion = generating.region;
+                indicesCurrent = false;
+
+                // the job's buffer can't be draw()'s, the next job may start before it's drawn
+                arrivedPalette = generating.palette;
+                if(arrivedPalette)
+                        std::swap(arrivedImage, backImage);
+                renderedExact = (generating.step == 1 && tilesLeft == 0);
+
+                if(generating.samples > 10000 && tilesLeft == 0)
+                        msPerSample = 0.7 * msPerSample + 0.3 * jobMs / generating.samples;
+
+                if(generating.interactive)
+                {
+                        values = backValues;
+                        refinePending = false;
+                }
+                else if(renderedExact)
+                {
+                        std::swap(values, backValues);
+                        anglesChanged = false;
+                        fullReevaluation = false;
+                        refinePending = false;
+                }
+                else
+                {
+                        // the next pass builds on this one
+                        values = backValues;
+
+                        if(generating.step > 1)
+                        {
+                                // samples of the preview are exact per pixel sums, which multi-rate rows aren't
+                                generating.previewed = (generating.step == 2 && generating.plan.coarseOctaves == 0);
+                                generating.refinesPrevious = true;
+                                generating.step /= 2;
+                        }
+                        refinePending = true;
+                }
+
+                stats.tileHits = tiles.hits;
+                stats.tileMisses = tiles.misses;
+                stats.tileBytes = tiles.bytesUsed();
+                stats.bandTimes = workers.bandTimes();
+                stats.octaveSamples = octaveCounters.evaluated;
+                stats.octavesSkipped = octaveCounters.skipped;
+
+                pending = std::max(pending, recolor);
+        }
+
+        void collectGeneration()
+        {
+                if(generator.collect())
+                        finishGeneration();
+        }
+
+        void render()
+        {
+                collectGeneration();
+
+                if((evaluationPending || refinePending) && !generator.busy())
+                {
+                        if(evaluationPending)
+                                generating = prepareValues();
+
+                        evaluationPending = false;
+                        refinePending = false;
+                        generating.samples = passSamples(generating);
+                        generating.palette = (paletteColoring ? currentPalette() : nullptr);
+                        generator.start([this](const std::atomic<bool>& cancelled)
+                        {
+                                auto t0 = std::chrono::steady_clock::now();
+                                bool done = generateValues(generating, backValues.data(), cancelled);
+                                jobMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                                return done;
+                        });
+                }
+
+                if(pending >= recolor)
+                        draw();
+
+                // until the values of the current view arrive the last ones are shown reprojected
+                MapView shown = currentView();
+                bool reprojecting = (mapImage && shown != renderedView);
+                if(reprojecting && shown != reprojectedView)
+                {
+                        reproject(shown);
+                        pending = std::max(pending, reblit);
+                }
+
+                if(pending >= reblit && mapImage)
+                {
+                        blit((reprojecting ? reprojectedImage : mapImage).get());
+                        if(changingSliceLimits)
+                                drawSlice();
+                }
+
+                pending = upToDate;
+        }
+
+        // copies image into the window's content a row at a time, the map is opaque
+        // so it doesn't need DrawSprite's per pixel modes and checks
+        void blit(const olc::Sprite* image)
+        {
+                PGEws::PixelSpan pixels = lGetPixels();
+                int width = std::min(image->width, pixels.width);
+                int height = std::min(image->height, pixels.height);
+                for(int y = 0; y < height; y++)
+                        std::memcpy(pixels.row(y), &image->pColData[y * image->width], width * sizeof(olc::Pixel));
+                lMarkDirty(0, 0, width, height);
+        }
+
+        // true if the view differs from the one asked for last by more than the snapping
+        // of prepareValues, which handlePanning undoes every frame while the mouse is held
+        bool viewMoved(const MapView& view)
+        {
+                if(view.scale != requestedView.scale || view.width != requestedView.width || view.height != requestedView.height)
+                        return true;
+
+                olc::vf2d pixels = (view.offset - requestedView.offset) * tvw.pixelsPerUnit();
+                if(std::abs(pixels.x) >= 0.5f || std::abs(pixels.y) >= 0.5f)
+                        return true;
+
+                tvw.setOffset(requestedView.offset);
+                return false;
         }
 
+public:
+        void needToRedraw() { invalidate(overlayChanged); }
+
         float getFromValuesArray(int x, int y)
         {
-                return values[y * WindowWidth() + x];
+                if(x < 0 || y < 0 || x >= renderedView.width || y >= renderedView.height)
+                        return 0.0f;
+
+                return values[y * renderedView.width + x];
         }
 
         int getSeed() { return seed; }
 
         int getNumberOfOctaves() { return numOctaves; }
 
+        int getVisibleOctaves() { return visibleOctaves(tvw.pixelsPerUnit()); }
+
+        const GenerationStats& getStats() { return stats; }
+
+        void setThreadCount(int threads)
+        {
+                cancelGeneration();
+                workers.resize(threads);
+        }
+
 public:
         olc::vf2d getSliceStart() { return startSlice; }
         olc::vf2d getSliceEnd() { return endSlice; }
 
+        // the map value at worldPos, with the octaves the map shows at the current zoom
         float getValue(olc::vf2d worldPos)
         {
+                int count = visibleOctaves(tvw.pixelsPerUnit());
+
                 float value = 0.0f;
                 float ampl = 1.0f;
-                for (int i = 0; i < numOctaves; i++, ampl /= amplRatio)
+                for (int i = 0; i < count; i++, ampl /= amplRatio)
                 {
-                        value += ampl * octaves[i].perlin(worldPos.x, worldPos.y);
+                        value += ampl * octaves[i].perlinAtOffset(worldPos.x, worldPos.y);
                 }
 
                 return 1.4f * value;
         }
 
         float getWaterLevel() { return waterLevel; }
-        void setWaterLevel(float newLevel) { waterLevel = newLevel; }
+        void setWaterLevel(float newLevel)
+        {
+                if(newLevel != waterLevel)
+                        invalidate(waterLevelChanged);
+                waterLevel = newLevel;
+        }
 
         bool isInSliceMode() { return changingSliceLimits; }
 
 private:
-        bool sliceInput()
+        void sliceInput()
         {
                 if(isResizing())
-                        return false;
+                        return;
 
-                bool recalculate = false;
                 olc::vi2d mousePos = lGetMousePos();
                 if(mousePos.x < 0)
-                        return false;
+                        return;
                 if(mousePos.y < 0)
-                        return false;
+                        return;
                 if(mousePos.x >= WindowWidth())
-                        return false;
+                        return;
                 if(mousePos.y >= WindowHeight())
-                        return false;
+                        return;
 
                 if(pge->GetMouse(0).bHeld)
                 {
-                        startSlice = tvw.PixelToWorld(mousePos);
-                        recalculate = true;
+                        olc::vf2d newStart = tvw.PixelToWorld(mousePos);
+                        if(newStart != startSlice)
+                                invalidate(overlayChanged);
+                        startSlice = newStart;
                 }
                 if(pge->GetMouse(1).bHeld)
                 {
-                        endSlice = tvw.PixelToWorld(mousePos);
-                        recalculate = true;
+                        olc::vf2d newEnd = tvw.PixelToWorld(mousePos);
+                        if(newEnd != endSlice)
+                                invalidate(overlayChanged);
+                        endSlice = newEnd;
                 }
-
-                return recalculate;
         }
 
-        bool userInput()
+        // view changes (C, Z, panning, zooming) are picked up by comparing the
+        // view with the rendered one, so they don't invalidate anything themselves
+        void userInput()
         {
                 if(isResizing())
-                        return false;
+                        return;
 
                 if(!pge->AnyKeyPressed())
-                        return false;
-
-                bool recalculate;
+                        return;
 
                 if(pge->GetKey(olc::Key::M).bPressed)
                 {
@@ -313,11 +1365,13 @@ private:
                         std::cout << lim << "\n";
                         land_interp_meth = hm::interpMeth(lim);
                         land_grad.setInterpolationMethod(land_interp_meth);
-                        redrawSignal = true;
+                        invalidate(colorsChanged);
                 }
 
                 if (pge->GetKey(olc::Key::A).bPressed)
 		{
+                        invalidate(gradientsChanged);
+
 			std::cout << "Angle offsets: ";
 			for (int i = 0; i < numOctaves; i++)
 			{
@@ -332,28 +1386,24 @@ private:
                                         octaves[i].angleOffset += 6.2831853f;
 
 				std::cout << octaves[i].angleOffset << " ";
-
-				octaves[i].setGradientVectors();
 			}
 			std::cout << "\n";
-			
-			recalculate = true;
 		}
 
 		if (pge->GetKey(olc::Key::UP).bPressed)
 		{
-			if (numOctaves < max_octaves)
+			if (numOctaves < maxOctaves())
 			{
+                                invalidate(octavesChanged);
+
 				numOctaves++;
 
 				if (numOctaves > octaves.size())
 				{
 					int freq = octaves.back().freq;
 					octaves.resize(octaves.size() + 1);
-					octaves.back().init(2 * freq);
+					initOctave(octaves.size() - 1, 2 * freq);
 				}
-
-				recalculate = true;
 			}
 		}
 
@@ -361,37 +1411,67 @@ private:
 		{
 			if (numOctaves > 1)
 			{
+                                invalidate(octavesChanged);
 				numOctaves--;
-				recalculate = true;
 			}
 		}
 
 		if (pge->GetKey(olc::Key::SPACE).bPressed)
 		{
+                        invalidate(seedChanged);
+
                         if(pge->GetKey(olc::Key::SHIFT).bHeld)
                                 seed--;
                         else
                                 seed++;
 			srand(seed);
                         std::cout << "seed: " << seed << "\n";
-			for (int i = 0; i < numOctaves; i++)
-			{
-				octaves[i].initAngles();
-				octaves[i].setGradientVectors();
-			}
-			recalculate = true;
+                        if(hashedGradients)
+                        {
+                                for (auto& octave : octaves)
+                                        octave.setSeed((uint32_t)seed);
+                        }
+                        else
+                        {
+                                for (int i = 0; i < numOctaves; i++)
+                                {
+                                        octaves[i].initAngles();
+                                        octaves[i].setGradientVectors();
+                                }
+                        }
 		}
 
+                if(pge->GetKey(olc::Key::G).bPressed)
+                {
+                        invalidate(latticeChanged);
+
+                        hashedGradients = !hashedGradients;
+                        std::cout << "gradients: " << (hashedGradients ? "hashed" : "lattice") << "\n";
+
+                        if(!hashedGradients)
+                        {
+                                if(numOctaves > max_octaves)
+                                        numOctaves = max_octaves;
+                                if(octaves.size() > size_t(max_octaves))
+                                        octaves.resize(max_octaves);
+                                srand(seed);
+                        }
+
+                        int freq = 4;
+                        for (size_t i = 0; i < octaves.size(); i++, freq *= 2)
+                                initOctave(i, freq);
+                }
+
 		if (pge->GetKey(olc::Key::R).bPressed)
 		{
+                        invalidate(amplRatioChanged);
+
 			if (pge->GetKey(olc::Key::SHIFT).bHeld)
 				amplRatio -= 0.1f;
 			else
 				amplRatio += 0.1f;
 
 			std::cout << "amplitude ratio: " << amplRatio << "\n";
-
-			recalculate = true;
 		}
 
 		if (pge->GetKey(olc::Key::W).bPressed)
@@ -403,9 +1483,59 @@ private:
 
 			std::cout << "water level: " << waterLevel << "\n";
 
-			recalculate = true;
+                        invalidate(waterLevelChanged);
 		}
 
+                if(pge->GetKey(olc::Key::P).bPressed)
+                {
+                        progressive = !progressive;
+                        std::cout << "progressive rendering: " << (progressive ? "on" : "off") << "\n";
+                }
+
+                if(pge->GetKey(olc::Key::L).bPressed)
+                {
+                        invalidate(octavesChanged);
+
+                        octaveCulling = !octaveCulling;
+                        std::cout << "octave culling: " << (octaveCulling ? "on" : "off") << "\n";
+                }
+
+                if(pge->GetKey(olc::Key::T).bPressed)
+                {
+                        invalidate(octavesChanged);
+
+                        earlyTermination = !earlyTermination;
+                        std::cout << "early termination: " << (earlyTermination ? "on" : "off") << "\n";
+                }
+
+                if(pge->GetKey(olc::Key::K).bPressed)
+                {
+                        // the job may be assembling tiles
+                        cancelGeneration();
+
+                        tiles.budgetBytes = (tiles.enabled() ? 0 : tileBudgetBytes);
+                        tiles.clear();
+                        std::cout << "tile cache: " << (tiles.enabled() ? "on" : "off") << "\n";
+                }
+
+                if(pge->GetKey(olc::Key::H).bPressed)
+                {
+                        invalidate(colorsChanged);
+
+                        paletteColoring = !paletteColoring;
+                        std::cout << "palette coloring: " << (paletteColoring ? "on" : "off") << "\n";
+                }
+
+                if(pge->GetKey(olc::Key::N).bPressed)
+                {
+                        if(pge->GetKey(olc::Key::SHIFT).bHeld)
+                                setThreadCount(workers.size() - 1);
+                        else
+                                setThreadCount(workers.size() + 1);
+
+                        std::cout << "threads: " << workers.size() << "\n";
+                }
+
 		if (pge->GetKey(olc::Key::F12).bPressed)
 		{
                         olc::Sprite* screenSpritePtr = pge->GetDrawTarget();
@@ -422,72 +1552,75 @@ private:
                         else
                         {
                                 changingSliceLimits = !changingSliceLimits;
-                                recalculate = true;
+                                invalidate(overlayChanged);
                         }
 		}
 
                 if(pge->GetKey(olc::Key::C).bPressed)
                 {
                         tvw.setOffset({0.0f,0.0f});
-
-                        recalculate = true;
                 }
 
                 if(pge->GetKey(olc::Key::Z).bPressed)
                 {
                         tvw.setScale(1.0f, lGetMousePos());
-
-                        recalculate = true;
                 }
-
-                return recalculate;
         }
 
 public:
 
         bool wOnUserUpdate(float fElapsedTime) override //I know, kind of a mess
         {
-                bool recalculate = false;
+                // before any input can cancel a finished job
+                collectGeneration();
 
-                if(isResizing())
-                {
-                        values.resize(WindowWidth()*WindowHeight());
-                        recalculate = true;
-                }
-
-                recalculate |= userInput();
+                userInput();
 
-                if(!redrawSignal)
+                if(isInFocus())
                 {
-                        if(!isInFocus() && !recalculate)
-                        {
-                                return true;
-                        }
-
                         bool inBounds = lMouseInBounds();
 
                         if(changingSliceLimits && !pge->GetKey(olc::Key::SHIFT).bHeld)
-                                recalculate |= sliceInput();
+                                sliceInput();
                         else if(inBounds)
-                                recalculate |= tvw.handlePanning();
+                                tvw.handlePanning();
 
                         if(inBounds)
-                                recalculate |= tvw.handleZooming();
+                                tvw.handleZooming();
                 }
 
-                recalculate |= isResizing();
+                // handlePanning isn't called once the mouse leaves the window, so panned can stay set
+                if((tvw.panned && pge->GetMouse(0).bHeld) || tvw.zoomed)
+                        sinceInteraction = 0.0f;
+                else
+                        sinceInteraction += fElapsedTime;
 
-                if(recalculate || redrawSignal)
+                if(settlePending && !interacting())
                 {
-                        recalculateAndDraw();
-                        if(changingSliceLimits)
-                                drawSlice();
+                        settlePending = false;
+                        cancelGeneration();
+                        evaluationPending = true;
+                        refinePending = false;
                 }
 
-                redrawSignal = false;
+                MapView view = currentView();
+                if(view.width != requestedView.width || view.height != requestedView.height)
+                        invalidate(windowResized);
+                else if(viewMoved(view))
+                        invalidate(viewChanged);
+
+                // the slice line is drawn in world space, so it moves with the view
+                if(evaluationPending && changingSliceLimits)
+                        invalidate(overlayChanged);
+
+                render();
 
                 return true;
         }
+
+private:
+        // declared last, so it's stopped before anything its job uses is destroyed
+        BackgroundJob generator;
 };
 
 class Info : public PGEws::Window
@@ -517,10 +1650,28 @@ public:
 
                 pge->DrawString(0,0,"Zoom: " + std::to_string(perlin_map->tvw.getScale()));
 
-                pge->DrawString(0, 30, "Number of octaves: " + std::to_string(perlin_map->getNumberOfOctaves()));
+                pge->DrawString(0, 30, "Number of octaves: " + std::to_string(perlin_map->getNumberOfOctaves()) + " (" + std::to_string(perlin_map->getVisibleOctaves()) + " drawn)");
 
                 pge->DrawString(0, 40, "Water level: " + std::to_string(perlin_map->getWaterLevel()));
 
+                const PerlinMap::GenerationStats& stats = perlin_map->getStats();
+                pge->DrawString(300, 0, "Tile hits: " + std::to_string(stats.tileHits));
+                pge->DrawString(300, 10, "Tile misses: " + std::to_string(stats.tileMisses));
+                pge->DrawString(300, 20, "Tile cache: " + std::to_string(stats.tileBytes >> 20) + " MB");
+
+                // the slowest and fastest thread of the last parallel evaluation show the load imbalance
+                const std::vector<double>& bandTimes = stats.bandTimes;
+                if(!bandTimes.empty())
+                {
+                        auto fastest = std::min_element(bandTimes.begin(), bandTimes.end());
+                        auto slowest = std::max_element(bandTimes.begin(), bandTimes.end());
+                        pge->DrawString(300, 30, "Threads: " + std::to_string(bandTimes.size()) + ", " + std::to_string(*fastest) + " - " + std::to_string(*slowest) + " ms");
+                }
+
+                uint64_t octaveTotal = stats.octaveSamples + stats.octavesSkipped;
+                if(octaveTotal > 0)
+                        pge->DrawString(300, 40, "Octaves skipped: " + std::to_string(stats.octavesSkipped) + " (" + std::to_string(stats.octavesSkipped * 100 / octaveTotal) + "%)");
+
                 if(!perlin_map->isInFocus() || !perlin_map->lMouseInBounds())
                         return true;
 
@@ -659,7 +1810,7 @@ public:
 public:
 	bool OnUserCreate() override
 	{
-                win.addNewWindow(new Controls(this, controls_window, "Controls", 15, 10, 450, 220));
+                win.addNewWindow(new Controls(this, controls_window, "Controls", 15, 10, 450, 320));
                 win.addNewWindow(new PerlinMap(this, perlin_window, "Perlin map", 15, 10, 150, 150, ~(PGEws::CanClose)));
                 win.addNewWindow(new Slice(this, slice_window, "Slice of terrain", 180, 10, 400, 150, ~(PGEws::CanClose)));
                 win.addNewWindow(new Info(this, info_window, "Map info", 15, 180, 565, 50));
@@ -679,7 +1830,7 @@ public:
                         {
                                 if(win.getIndexOfId(controls_window) == -1)
                                 {
-                                        win.addNewWindow(new Controls(this, controls_window, "Controls", 15, 10, 450, 220));
+                                        win.addNewWindow(new Controls(this, controls_window, "Controls", 15, 10, 450, 320));
                                         
                                         win.changeFocusedWindow(controls_window);
                                 }
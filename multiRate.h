@@ -0,0 +1,128 @@
+#pragma once
+#include "perlinOctave.h"
+#include <cmath>
+#include <vector>
+
+// Multi-rate evaluation: the low octaves are smooth at the pixel scale, so their sum
+// is sampled every spacing pixels and reconstructed with Catmull-Rom splines, and only
+// the octaves above them are evaluated at every pixel. The samples are at multiples of
+// spacing on the global pixel grid (global pixel gx is the world point gx / pixelsPerUnit),
+// so a pixel gets the same value whatever region it's evaluated with.
+namespace multirate
+{
+        // reconstructing an octave sampled c lattice cells apart is off by at most
+        // about 0.75 * c^2 (measured), errorScale leaves some room
+        constexpr float errorScale = 1.0f;
+
+        // below it the reconstruction costs about as much as the octaves it replaces
+        constexpr int minSpacing = 4;
+
+        struct Plan
+        {
+                int coarseOctaves = 0; // octaves 0 .. coarseOctaves - 1 are reconstructed
+                int spacing = 1;       // pixels between their samples
+        };
+
+        // The most octaves whose reconstruction stays within tolerance (of the final,
+        // 1.4 scaled value) at a spacing of at least minSpacing. The last octave is
+        // always left to the per pixel evaluation.
+        inline Plan plan(const perlinOctave* octaves, const float* ampl, int numOctaves, float pixelsPerUnit, float tolerance)
+        {
+                Plan best;
+                double weight = 0.0; // error per squared world unit of spacing
+                for(int m = 1; m < numOctaves; m++)
+                {
+                        double freq = octaves[m - 1].freq;
+                        weight += 1.4 * errorScale * ampl[m - 1] * freq * freq;
+
+                        int spacing = (int)(pixelsPerUnit * std::sqrt(tolerance / weight));
+                        if(spacing < minSpacing)
+                                break;
+
+                        best.coarseOctaves = m;
+                        best.spacing = spacing;
+                }
+                return best;
+        }
+
+        // the samples and spline weights of every pixel along one axis of a region
+        struct Axis
+        {
+                long long first; // sample index of the first sample
+                int samples;
+                std::vector<int> node;      // per pixel, the first of its four samples (from first)
+                std::vector<float> weight;  // per pixel, four weights
+
+                // the pixels origin + begin .. origin + begin + count - 1 (begin and
+                // the pixel are added to origin as one integer, so a pixel's weights
+                // don't depend on where the region starts)
+                void init(double origin, int begin, int count, int spacing)
+                {
+                        first = (long long)std::floor((origin + begin) / spacing) - 1;
+                        samples = int((long long)std::floor((origin + (begin + count - 1)) / spacing) + 2 - first + 1);
+
+                        node.resize(count);
+                        weight.resize(4 * count);
+                        for(int p = 0; p < count; p++)
+                        {
+                                double s = (origin + (begin + p)) / spacing;
+                                long long k = (long long)std::floor(s);
+                                float t = float(s - k);
+
+                                node[p] = int(k - 1 - first);
+                                weight[4 * p + 0] = 0.5f * t * (-1.0f + t * (2.0f - t));
+                                weight[4 * p + 1] = 0.5f * (2.0f + t * t * (-5.0f + 3.0f * t));
+                                weight[4 * p + 2] = 0.5f * t * (1.0f + t * (4.0f - 3.0f * t));
+                                weight[4 * p + 3] = 0.5f * t * t * (t - 1.0f);
+                        }
+                }
+        };
+
+        // Writes the reconstructed sum of the coarse octaves (ampl weighted, not scaled or
+        // clamped) of a width x height region to out. Its top left pixel is (x0, y0) from
+        // the global pixel (originX, originY).
+        inline void coarseSums(const Plan& plan, const perlinOctave* octaves, const float* ampl, float pixelsPerUnit,
+                               double originX, double originY, int x0, int y0, float* out, int width, int height)
+        {
+                Axis ax, ay;
+                ax.init(originX, x0, width, plan.spacing);
+                ay.init(originY, y0, height, plan.spacing);
+
+                std::vector<float> xs(ax.samples);
+                for(int k = 0; k < ax.samples; k++)
+                        xs[k] = perlinOctave::wrapCoord(float(double((ax.first + k) * plan.spacing) / pixelsPerUnit));
+
+                std::vector<perlinOctave::RowKernel> accumulate(plan.coarseOctaves);
+                for(int i = 0; i < plan.coarseOctaves; i++)
+                        accumulate[i] = (octaves[i].coherentPays(float(plan.spacing / pixelsPerUnit)) ? perlinOctave::coherentKernel() : perlinOctave::accumulateKernel());
+
+                // the samples, splined across every pixel column, one row per sample row
+                std::vector<float> samples(ax.samples);
+                std::vector<float> across((size_t)ay.samples * width);
+                for(int j = 0; j < ay.samples; j++)
+                {
+                        float y = float(double((ay.first + j) * plan.spacing) / pixelsPerUnit);
+
+                        std::fill(samples.begin(), samples.end(), 0.0f);
+                        for(int i = 0; i < plan.coarseOctaves; i++)
+                                accumulate[i](octaves[i].prepareRow(y), xs.data(), ampl[i], samples.data(), ax.samples);
+
+                        float* row = &across[(size_t)j * width];
+                        for(int x = 0; x < width; x++)
+                        {
+                                const float* s = &samples[ax.node[x]];
+                                const float* w = &ax.weight[4 * x];
+                                row[x] = w[0] * s[0] + w[1] * s[1] + w[2] * s[2] + w[3] * s[3];
+                        }
+                }
+
+                for(int y = 0; y < height; y++)
+                {
+                        const float* w = &ay.weight[4 * y];
+                        const float* r = &across[(size_t)ay.node[y] * width];
+                        float* row = &out[(size_t)y * width];
+                        for(int x = 0; x < width; x++)
+                                row[x] = w[0] * r[x] + w[1] * r[x + width] + w[2] * r[x + 2 * width] + w[3] * r[x + 3 * width];
+                }
+        }
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include "perlinOctave.h"
+#include "alignedAllocator.h"
+#include "threadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+
+// The raw noise of one octave over the current view. n0 is the noise of the
+// octave's gradients, which are turned to refOffset. If hasBasis is set, n1 holds the noise of the
+// same gradients turned by 90 degrees, and the octave at any other angle offset t
+// is cos(t - refOffset) * n0 + sin(t - refOffset) * n1, so changing angle
+// offsets costs a blend instead of a noise evaluation.
+struct OctaveLayer
+{
+        aligned_vector<float> n0;
+        aligned_vector<float> n1;
+        float refOffset = 0.0f;
+        bool valid = false;
+        bool hasBasis = false;
+
+        // rowX holds the wrapped world x of every column, rowY the world y of every row.
+        // If cancelled gets set midway the layer is left invalid.
+        void evaluate(const perlinOctave& octave, const float* rowX, const float* rowY, int width, int height, bool basis, ThreadPool& pool,
+                      const std::atomic<bool>* cancelled = nullptr)
+        {
+                valid = false;
+
+                n0.resize(width * height);
+
+                if(basis)
+                {
+                        n1.resize(width * height);
+
+                        const perlinOctave::BasisKernel kernel = perlinOctave::basisKernel();
+                        pool.run(height, [&](int begin, int end)
+                        {
+                                for(int y = begin; y < end && !(cancelled && *cancelled); y++)
+                                        kernel(octave.prepareRow(rowY[y]), rowX, &n0[y * width], &n1[y * width], width);
+                        });
+                }
+                else
+                {
+                        aligned_vector<float>().swap(n1);
+
+                        const perlinOctave::RowKernel kernel = perlinOctave::rowKernel();
+                        pool.run(height, [&](int begin, int end)
+                        {
+                                for(int y = begin; y < end && !(cancelled && *cancelled); y++)
+                                        kernel(octave.prepareRow(rowY[y]), rowX, 0.0f, &n0[y * width], width);
+                        });
+                }
+
+                if(cancelled && *cancelled)
+                        return;
+
+                refOffset = octave.gradientOffset;
+                hasBasis = basis;
+                valid = true;
+        }
+
+        // true if the layer can give the octave at this angle offset
+        bool usable(float angleOffset) const { return valid && (hasBasis || angleOffset == refOffset); }
+
+        size_t bytes() const { return (n0.capacity() + n1.capacity()) * sizeof(float); }
+
+        void release()
+        {
+                aligned_vector<float>().swap(n0);
+                aligned_vector<float>().swap(n1);
+                valid = false;
+                hasBasis = false;
+        }
+};
+
+// Per octave layers of the current view under a memory budget. Layers of
+// octaves that are switched off stay cached (so UP can bring them back with a
+// blend) until the budget runs out; they are evicted least recently used first.
+class OctaveLayerCache
+{
+public:
+        size_t budgetBytes = size_t(256) << 20;
+
+        OctaveLayer& operator[](int i) { return layers[i]; }
+
+        int size() const { return (int)layers.size(); }
+
+        void resize(int n)
+        {
+                if(n > size())
+                {
+                        layers.resize(n);
+                        lastUse.resize(n, 0);
+                }
+        }
+
+        void invalidate()
+        {
+                for(auto& layer : layers)
+                        layer.valid = false;
+        }
+
+        void invalidate(int i)
+        {
+                if(i < size())
+                        layers[i].valid = false;
+        }
+
+        void touch(int i) { lastUse[i] = ++clock; }
+
+        size_t bytesUsed() const
+        {
+                size_t bytes = 0;
+                for(const auto& layer : layers)
+                        bytes += layer.bytes();
+                return bytes;
+        }
+
+        // whether the active octaves alone fit in the budget
+        bool fits(int numOctaves, int pixels, bool basis) const
+        {
+                return size_t(numOctaves) * pixels * sizeof(float) * (basis ? 2 : 1) <= budgetBytes;
+        }
+
+        // frees invalid layers, then inactive ones (index >= numOctaves) least
+        // recently used first, until the cache is within budget
+        void evict(int numOctaves)
+        {
+                for(auto& layer : layers)
+                        if(!layer.valid)
+                                layer.release();
+
+                size_t used = bytesUsed();
+                while(used > budgetBytes)
+                {
+                        int oldest = -1;
+                        for(int i = numOctaves; i < size(); i++)
+                                if(layers[i].valid && (oldest == -1 || lastUse[i] < lastUse[oldest]))
+                                        oldest = i;
+
+                        if(oldest == -1)
+                                break;
+
+                        used -= layers[oldest].bytes();
+                        layers[oldest].release();
+                }
+        }
+
+        // out = clamp(1.4 * sum of ampl[i] * octave i at angleOffset[i]). For octaves at
+        // their reference offset the layers are the octaves' perlin() values, so this is
+        // the sum getValue() gives. The fused evaluator differs from it within the bounds
+        // of perlinOctave::coherentKernel() and of multirate::plan's tolerance.
+        void blend(const float* ampl, const float* angleOffset, int numOctaves, float* out, int count, ThreadPool& pool,
+                   const std::function<void(int first, int count)>* blended = nullptr)
+        {
+                for(int i = 0; i < numOctaves; i++)
+                        touch(i);
+
+                // every pixel sums its octaves in the same order, however the pixels are split;
+                // the bands are blended a chunk at a time so that out stays in cache, blended
+                // is called with each chunk once it's done
+                pool.run(count, [&](int begin, int end)
+                {
+                        for(int first = begin; first < end; first += blendChunk)
+                        {
+                                int chunk = std::min(blendChunk, end - first);
+                                blendRange(ampl, angleOffset, numOctaves, out + first, first, chunk);
+                                if(blended)
+                                        (*blended)(first, chunk);
+                        }
+                });
+        }
+
+private:
+        static constexpr int blendChunk = 4096;
+
+        std::vector<OctaveLayer> layers;
+        std::vector<uint64_t> lastUse;
+        uint64_t clock = 0;
+
+        // blend of the pixels [first, first + count) of the layers
+        void blendRange(const float* ampl, const float* angleOffset, int numOctaves, float* out, int first, int count)
+        {
+                std::fill(out, out + count, 0.0f);
+
+                for(int i = 0; i < numOctaves; i++)
+                {
+                        const OctaveLayer& layer = layers[i];
+                        const float* n0 = layer.n0.data() + first;
+                        float t = angleOffset[i] - layer.refOffset;
+
+                        if(t == 0.0f)
+                        {
+                                const float a = ampl[i];
+                                for(int p = 0; p < count; p++)
+                                        out[p] += a * n0[p];
+                        }
+                        else
+                        {
+                                const float* n1 = layer.n1.data() + first;
+                                const float w0 = ampl[i] * std::cos(t);
+                                const float w1 = ampl[i] * std::sin(t);
+                                for(int p = 0; p < count; p++)
+                                        out[p] += w0 * n0[p] + w1 * n1[p];
+                        }
+                }
+
+                for(int p = 0; p < count; p++)
+                {
+                        float v = out[p] * 1.4f;
+                        out[p] = (v > 1.0f ? 1.0f : (v < -1.0f ? -1.0f : v));
+                }
+        }
+};
@@ -1,6 +1,13 @@
 #pragma once
 #include <vector>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <cstdint>
+#include "cpuFeatures.h"
+#include "alignedAllocator.h"
+
 class perlinOctave
 {
 public:
@@ -8,19 +15,38 @@ public:
 	void init(int frequency)
 	{
 		freq = frequency;
+		source = lattice;
 
-		angles.resize(freq + 1);
-		gridGradientVectors.resize(freq + 1);
-		for (int i = 0; i <= freq; i++)
-		{
-			gridGradientVectors[i].resize(freq + 1);
-			angles[i].resize(freq + 1);
-		}
+		// rows are padded to whole cache lines (8 gradients), so a lattice row
+		// never shares a line with the next one
+		stride = (freq + 1 + 7) & ~7;
+
+		angles.assign(freq * freq, 0.0f);
+		gridGradientVectors.assign(stride * (freq + 1), vf2());
 		initAngles();
 
 		setGradientVectors();
 	}
 
+	// Gradients derived on the fly from a hash of (seed, octave, ix, iy) instead of
+	// a stored lattice: no per octave storage and no rand() state, so any number of
+	// octaves can be used and reseeding is O(1).
+	void initHashed(int frequency, uint32_t seed, int octave)
+	{
+		freq = frequency;
+		source = hashed;
+		octaveIndex = octave;
+		hashSeed = seed;
+
+		stride = 0;
+		aligned_vector<vf2>().swap(gridGradientVectors);
+		std::vector<float>().swap(angles);
+
+		setGradientVectors();
+	}
+
+	void setSeed(uint32_t seed) { hashSeed = seed; }
+
 	struct vf2
 	{
 		vf2() : x(0), y(0) {}
@@ -30,40 +56,101 @@ public:
 	};
 
 	int freq;
-	std::vector<std::vector<vf2>> gridGradientVectors;
-	std::vector<std::vector<float>> angles;
+	int stride; // distance between two lattice rows in gridGradientVectors
+	aligned_vector<vf2> gridGradientVectors; // (freq + 1) rows, row freq and column freq repeat row and column 0
+	std::vector<float> angles; // freq * freq
 	float angleOffset = 0.0f;
+	// the angle offset the gradients are turned to; changing angleOffset doesn't turn
+	// them, blending octave layers with a basis doesn't need them to be
+	float gradientOffset = 0.0f;
+
+	enum GradientSource { lattice, hashed };
+	GradientSource source = lattice;
+
+	static const int hashedDirections = 256;
+	uint32_t hashSeed = 0;
+	int octaveIndex = 0;
+	vf2 hashedGradients[hashedDirections]; // unit vectors rotated by angleOffset
+
+	vf2* gradientRow(int iy) { return &gridGradientVectors[iy * stride]; }
+	const vf2* gradientRow(int iy) const { return &gridGradientVectors[iy * stride]; }
+	float& angle(int ix, int iy) { return angles[iy * freq + ix]; }
 
 	void initAngles()
 	{
+		if (source == hashed)
+			return;
+
 		for (int y = 0; y < freq; y++)
 		{
 			for (int x = 0; x < freq; x++)
 			{
-				angles[y][x] = float(rand() % 1000) * 0.00628318530718f;
+				angle(x, y) = float(rand() % 1000) * 0.00628318530718f;
 			}
 		}
 	}
 
+	void updateGradientVectors()
+	{
+		if (gradientOffset != angleOffset)
+			setGradientVectors();
+	}
+
 	void setGradientVectors()
 	{
-		for (int y = 0; y < freq; y++)
+		gradientOffset = angleOffset;
+
+		if (source == hashed)
 		{
-			for (int x = 0; x < freq; x++)
+			for (int i = 0; i < hashedDirections; i++)
 			{
-				float angle = angles[y][x] + angleOffset;
-				gridGradientVectors[y][x] = { cos(angle),sin(angle)};
+				float a = float(i) * (6.28318530718f / hashedDirections) + angleOffset;
+				hashedGradients[i] = { cos(a),sin(a) };
 			}
-			gridGradientVectors[y][freq] = gridGradientVectors[y][0];
+			return;
 		}
-		for (int x = 0; x <= freq; x++)
+
+		for (int y = 0; y < freq; y++)
 		{
-			gridGradientVectors[freq][x] = gridGradientVectors[0][x];
+			vf2* row = gradientRow(y);
+			for (int x = 0; x < freq; x++)
+			{
+				float a = angle(x, y) + angleOffset;
+				row[x] = { cos(a),sin(a)};
+			}
+			row[freq] = row[0];
 		}
+		std::copy(gradientRow(0), gradientRow(0) + freq + 1, gradientRow(freq));
 
 		//for (int y = 0; y <= freq; y++)
 		//	for (int x = 0; x <= freq; x++)
-		//		std::cout << x << "," << y << "  " << gridGradientVectors[y][x].x << ", " << gridGradientVectors[y][x].y << "\n";
+		//		std::cout << x << "," << y << "  " << gradientRow(y)[x].x << ", " << gradientRow(y)[x].y << "\n";
+	}
+
+	// the lattice repeats after freq cells, index freq is cell 0 again
+	uint32_t wrapCell(int i) const { return uint32_t(i == freq ? 0 : i); }
+
+	static uint32_t hashRow(uint32_t seed, int octave, uint32_t iy)
+	{
+		return seed * 0x9E3779B1u + uint32_t(octave) * 0x85EBCA77u + iy * 0xC2B2AE3Du;
+	}
+
+	static uint32_t hashCorner(uint32_t row, uint32_t ix)
+	{
+		uint32_t h = row ^ (ix * 0x27D4EB2Fu);
+		h ^= h >> 15;
+		h *= 0x2C1B3C6Du;
+		h ^= h >> 12;
+		h *= 0x297A2D39u;
+		h ^= h >> 15;
+		return h >> 24; // index into hashedGradients
+	}
+
+	vf2 gradientAt(int ix, int iy) const
+	{
+		if (source == hashed)
+			return hashedGradients[hashCorner(hashRow(hashSeed, octaveIndex, wrapCell(iy)), wrapCell(ix))];
+		return gradientRow(iy)[ix];
 	}
 
 	float dotGridGradient(float x, float y, int offx, int offy, bool debug = false)
@@ -71,7 +158,7 @@ public:
 		int ix = int(x * freq) + offx;
 		int iy = int(y * freq) + offy;
 
-		vf2 gradient = gridGradientVectors[iy][ix];
+		vf2 gradient = gradientAt(ix, iy);
 
 		float dx = x - (float)ix/(float)freq;
 		float dy = y - (float)iy/(float)freq;
@@ -87,7 +174,7 @@ public:
 		return dx * gradient.x + dy * gradient.y;
 	}
 
-	float interpolate(float a0, float a1, float w)
+	static float interpolate(float a0, float a1, float w)
 	{
 		//return a0 + (a1 - a0) * w;
 		return a0 + (a1 - a0) * (3.0f - w * 2.0f) * w * w;
@@ -97,10 +184,11 @@ public:
 	{
 		x = (x >= 0 ? x - floor(x) : x - (float(int(x)) - 1.0f) );
 		y = (y >= 0 ? y - floor(y) : y - (float(int(y)) - 1.0f) );
+		// a value just below an integer can round up to 1, which is 0 again
 		if (x == 1.0f)
-			x -= 0.001f;
+			x = 0.0f;
 		if (y == 1.0f)
-			y -= 0.001f;
+			y = 0.0f;
 
 		float cx = floor(x * freq) / freq;
 		float cy = floor(y * freq) / freq;
@@ -118,5 +206,789 @@ public:
 
 		return interpolate(ix0, ix1, sy);
 	}
-};
 
+	// perlin(x, y) at angleOffset, also while the gradients are still turned to
+	// gradientOffset: the noise of turned gradients is a blend of the noise of the
+	// gradients and of the gradients turned by 90 degrees
+	float perlinAtOffset(float x, float y)
+	{
+		if (gradientOffset == angleOffset)
+			return perlin(x, y);
+
+		RowState rs = prepareRow(y);
+		float n0, n1;
+		if (rs.hashed)
+			basisLane<true>(rs, wrapCoord(x), &n0, &n1);
+		else
+			basisLane<false>(rs, wrapCoord(x), &n0, &n1);
+
+		float turn = angleOffset - gradientOffset;
+		return cos(turn) * n0 + sin(turn) * n1;
+	}
+
+	// Batch evaluation. perlinRow(xs, y, out, n) gives the same result as calling
+	// perlin(xs[i], y) for every i: the SIMD kernels do the same float operations
+	// in the same order, so the results are bit identical unless the compiler
+	// contracts the scalar path into FMAs (-march with FMA enabled), in which case
+	// they differ by a few ulps (below 1e-6).
+public:
+	struct RowState
+	{
+		const vf2* row0; // gradients on the lattice row above the sample row
+		const vf2* row1; // and below it, both hashedGradients for hashed octaves
+		float freqF;
+		float sy;  // y offset from row0, also the vertical interpolation weight
+		float dy1; // y offset from row1
+
+		bool hashed;
+		int freq;
+		uint32_t hash0; // hashRow of the two lattice rows
+		uint32_t hash1;
+	};
+
+	static float wrapCoord(float v)
+	{
+		v = (v >= 0 ? v - floor(v) : v - (float(int(v)) - 1.0f));
+		if (v == 1.0f)
+			v = 0.0f;
+		return v;
+	}
+
+	RowState prepareRow(float y) const
+	{
+		y = wrapCoord(y);
+
+		int iy = int(y * freq);
+
+		RowState rs;
+		rs.freqF = (float)freq;
+		rs.sy = (y - (float)iy / rs.freqF) * rs.freqF;
+		rs.dy1 = (y - (float)(iy + 1) / rs.freqF) * rs.freqF;
+
+		rs.hashed = (source == hashed);
+		rs.freq = freq;
+		if (rs.hashed)
+		{
+			rs.row0 = rs.row1 = hashedGradients;
+			rs.hash0 = hashRow(hashSeed, octaveIndex, wrapCell(iy));
+			rs.hash1 = hashRow(hashSeed, octaveIndex, wrapCell(iy + 1));
+		}
+		else
+		{
+			rs.row0 = gradientRow(iy);
+			rs.row1 = gradientRow(iy + 1);
+			rs.hash0 = rs.hash1 = 0;
+		}
+		return rs;
+	}
+
+	void perlinRow(const float* xs, float y, float* out, int n) const
+	{
+		for (int i = 0; i < n; i++)
+			out[i] = wrapCoord(xs[i]);
+
+		RowState rs = prepareRow(y);
+		rowKernel()(rs, out, 0.0f, out, n);
+	}
+
+	// xs have to be wrapped already, xs and out may alias. The store kernel
+	// ignores ampl, the accumulate kernel does out[i] += ampl * noise.
+	typedef void (*RowKernel)(const RowState& rs, const float* xs, float ampl, float* out, int n);
+
+	static RowKernel rowKernel()
+	{
+		static const RowKernel kernel = selectKernel<false>();
+		return kernel;
+	}
+
+	static RowKernel accumulateKernel()
+	{
+		static const RowKernel kernel = selectKernel<true>();
+		return kernel;
+	}
+
+	// Noise is linear in the gradients, so rotating every gradient by t gives
+	// cos(t) * out0 + sin(t) * out1, where out0 is the noise of the current
+	// gradients (same values as the store kernel) and out1 the noise of the
+	// gradients turned by 90 degrees.
+	typedef void (*BasisKernel)(const RowState& rs, const float* xs, float* out0, float* out1, int n);
+
+	static BasisKernel basisKernel()
+	{
+#if PERLIN_X86_SIMD
+		static const BasisKernel kernel = cpu::hasAVX2() ? basisAVX2 : basisSSE2;
+#else
+		static const BasisKernel kernel = basisScalar;
+#endif
+		return kernel;
+	}
+
+	static const char* rowKernelName()
+	{
+#if PERLIN_X86_SIMD
+		return cpu::hasAVX2() ? "AVX2" : "SSE2";
+#else
+		return "scalar";
+#endif
+	}
+
+	// Cell coherent accumulation, for octaves whose cells span many pixels. Along a
+	// row the noise of one cell is a quartic in sx, so the corners are fetched once
+	// per cell and the quartic is stepped across its pixels by forward differencing,
+	// re-anchored every anchorInterval pixels so the rounding can't build up. Same
+	// signature as accumulateKernel(), but xs have to be evenly spaced (apart from
+	// where they wrap). They are only as even as float allows: a view's world x is
+	// rounded to the ulp of its magnitude before it is wrapped, and the per pixel
+	// kernels follow that rounding while the stepped quartic runs along the line
+	// through the anchors. So the results differ from accumulateKernel() by up to
+	// about 1.5 * ampl * freq * ulp(x), x the largest world x of the row before
+	// wrapping, plus a few 1e-6 of rounding of sx: below 1e-5 near the origin, but
+	// up to 4e-4 for freq 32 at x around 123, and linear in the distance from it.
+	static constexpr int anchorInterval = 128;
+
+	// pixels per cell below which the per cell setup costs more than the gathers it saves
+	static constexpr float coherentCellPixels = 24.0f;
+
+	static RowKernel coherentKernel()
+	{
+#if PERLIN_X86_SIMD
+		static const RowKernel kernel = cpu::hasAVX2() ? coherentAVX2 : coherentSSE2;
+#else
+		static const RowKernel kernel = coherentScalar;
+#endif
+		return kernel;
+	}
+
+	// whether a row whose xs are step apart is better done by the coherent kernel
+	bool coherentPays(float step) const
+	{
+		return step > 0.0f && step * (float)freq * coherentCellPixels <= 1.0f;
+	}
+
+private:
+	template<bool Accumulate>
+	static RowKernel selectKernel()
+	{
+#if PERLIN_X86_SIMD
+		return cpu::hasAVX2() ? rowAVX2<Accumulate> : rowSSE2<Accumulate>;
+#else
+		return rowScalar<Accumulate>;
+#endif
+	}
+
+	template<bool Accumulate>
+	static void storeLane(float* out, float ampl, float value)
+	{
+		if (Accumulate)
+			*out += ampl * value;
+		else
+			*out = value;
+	}
+
+	// the four corner gradients of cell ix on the sample row
+	template<bool Hashed>
+	static void cornerGradients(const RowState& rs, int ix, const vf2** g)
+	{
+		if (Hashed)
+		{
+			uint32_t c0 = uint32_t(ix);
+			uint32_t c1 = uint32_t(ix + 1 == rs.freq ? 0 : ix + 1);
+			g[0] = rs.row0 + hashCorner(rs.hash0, c0);
+			g[1] = rs.row0 + hashCorner(rs.hash0, c1);
+			g[2] = rs.row1 + hashCorner(rs.hash1, c0);
+			g[3] = rs.row1 + hashCorner(rs.hash1, c1);
+		}
+		else
+		{
+			g[0] = rs.row0 + ix;
+			g[1] = rs.row0 + ix + 1;
+			g[2] = rs.row1 + ix;
+			g[3] = rs.row1 + ix + 1;
+		}
+	}
+
+	template<bool Hashed>
+	static float noiseLane(const RowState& rs, float x)
+	{
+		int ix = int(x * rs.freqF);
+
+		float sx = (x - (float)ix / rs.freqF) * rs.freqF;
+		float dx1 = (x - (float)(ix + 1) / rs.freqF) * rs.freqF;
+
+		const vf2* g[4];
+		cornerGradients<Hashed>(rs, ix, g);
+
+		float ix0 = interpolate(sx * g[0]->x + rs.sy * g[0]->y, dx1 * g[1]->x + rs.sy * g[1]->y, sx);
+		float ix1 = interpolate(sx * g[2]->x + rs.dy1 * g[2]->y, dx1 * g[3]->x + rs.dy1 * g[3]->y, sx);
+
+		return interpolate(ix0, ix1, rs.sy);
+	}
+
+	template<bool Accumulate, bool Hashed>
+	static void rowScalarT(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		for (int i = 0; i < n; i++)
+			storeLane<Accumulate>(out + i, ampl, noiseLane<Hashed>(rs, xs[i]));
+	}
+
+	template<bool Accumulate>
+	static void rowScalar(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			rowScalarT<Accumulate, true>(rs, xs, ampl, out, n);
+		else
+			rowScalarT<Accumulate, false>(rs, xs, ampl, out, n);
+	}
+
+	template<bool Hashed>
+	static void basisLane(const RowState& rs, float x, float* out0, float* out1)
+	{
+		int ix = int(x * rs.freqF);
+
+		float sx = (x - (float)ix / rs.freqF) * rs.freqF;
+		float dx1 = (x - (float)(ix + 1) / rs.freqF) * rs.freqF;
+
+		const vf2* g[4];
+		cornerGradients<Hashed>(rs, ix, g);
+
+		float ix0 = interpolate(sx * g[0]->x + rs.sy * g[0]->y, dx1 * g[1]->x + rs.sy * g[1]->y, sx);
+		float ix1 = interpolate(sx * g[2]->x + rs.dy1 * g[2]->y, dx1 * g[3]->x + rs.dy1 * g[3]->y, sx);
+		*out0 = interpolate(ix0, ix1, rs.sy);
+
+		// perpendicular gradient (-g.y, g.x)
+		float px0 = interpolate(rs.sy * g[0]->x - sx * g[0]->y, rs.sy * g[1]->x - dx1 * g[1]->y, sx);
+		float px1 = interpolate(rs.dy1 * g[2]->x - sx * g[2]->y, rs.dy1 * g[3]->x - dx1 * g[3]->y, sx);
+		*out1 = interpolate(px0, px1, rs.sy);
+	}
+
+	template<bool Hashed>
+	static void basisScalarT(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		for (int i = 0; i < n; i++)
+			basisLane<Hashed>(rs, xs[i], out0 + i, out1 + i);
+	}
+
+	static void basisScalar(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		if (rs.hashed)
+			basisScalarT<true>(rs, xs, out0, out1, n);
+		else
+			basisScalarT<false>(rs, xs, out0, out1, n);
+	}
+
+	// The noise of cell ix along the sample row, times ampl, as c[0] + c[1] s + ... + c[4] s^4
+	// in sx. Interpolating the two lattice rows with the row's fixed vertical weight first
+	// leaves A(s) + (B(s) - A(s)) * (3 s^2 - 2 s^3), with A and B linear.
+	template<bool Hashed>
+	static void cellQuartic(const RowState& rs, int ix, float ampl, float* c)
+	{
+		const vf2* g[4];
+		cornerGradients<Hashed>(rs, ix, g);
+
+		float ft = (3.0f - rs.sy * 2.0f) * rs.sy * rs.sy;
+		float a0 = (1.0f - ft) * rs.sy * g[0]->y + ft * rs.dy1 * g[2]->y;
+		float a1 = (1.0f - ft) * g[0]->x + ft * g[2]->x;
+		float b1 = (1.0f - ft) * g[1]->x + ft * g[3]->x;
+		float b0 = (1.0f - ft) * rs.sy * g[1]->y + ft * rs.dy1 * g[3]->y - b1;
+		float d0 = b0 - a0, d1 = b1 - a1;
+
+		c[0] = ampl * a0;
+		c[1] = ampl * a1;
+		c[2] = ampl * 3.0f * d0;
+		c[3] = ampl * (3.0f * d1 - 2.0f * d0);
+		c[4] = ampl * -2.0f * d1;
+	}
+
+	// The forward differences of the quartic c from s with step h. They come from its
+	// Taylor coefficients at s rather than from differencing values, which would
+	// cancel away the small higher differences.
+	static void forwardDifferences(const float* c, float s, float h, float* d)
+	{
+		float e1 = c[1] + s * (2.0f * c[2] + s * (3.0f * c[3] + s * 4.0f * c[4]));
+		float e2 = c[2] + s * (3.0f * c[3] + s * 6.0f * c[4]);
+		float e3 = c[3] + s * 4.0f * c[4];
+		float h2 = h * h;
+		float E1 = e1 * h, E2 = e2 * h2, E3 = e3 * h2 * h, E4 = c[4] * h2 * h2;
+
+		d[0] = c[0] + s * (c[1] + s * (c[2] + s * (c[3] + s * c[4])));
+		d[1] = E1 + E2 + E3 + E4;
+		d[2] = 2.0f * E2 + 6.0f * E3 + 14.0f * E4;
+		d[3] = 6.0f * E3 + 36.0f * E4;
+		d[4] = 24.0f * E4;
+	}
+
+	// adds the quartic c at s, s + h, ... to out[0 .. n - 1]
+	static void stepQuartic(const float* c, float s, float h, float* out, int n)
+	{
+		float d[5];
+		forwardDifferences(c, s, h, d);
+		for (int i = 0; i < n; i++)
+		{
+			out[i] += d[0];
+			d[0] += d[1];
+			d[1] += d[2];
+			d[2] += d[3];
+			d[3] += d[4];
+		}
+	}
+
+	// the end of the run of pixels from i that are in the cell of xs[i] (ix)
+	static int cellRun(const RowState& rs, const float* xs, int i, int n, int& ix)
+	{
+		ix = int(xs[i] * rs.freqF);
+
+		int end = i + 1;
+		if (end < n && xs[end] > xs[i])
+		{
+			// jump to where the spacing says the cell ends, then correct that
+			float left = ((float)(ix + 1) / rs.freqF - xs[i]) / (xs[end] - xs[i]);
+			end = i + std::max(1, (int)std::ceil(std::min(left, float(n - i))));
+			while (end > i + 1 && int(xs[end - 1] * rs.freqF) != ix)
+				end--;
+		}
+		while (end < n && int(xs[end] * rs.freqF) == ix)
+			end++;
+		return end;
+	}
+
+	// sx of pixel a and the step of sx up to pixel last - 1
+	static void anchor(const RowState& rs, const float* xs, int ix, int a, int last, float& s, float& h)
+	{
+		s = (xs[a] - (float)ix / rs.freqF) * rs.freqF;
+		h = (last - 1 > a ? (xs[last - 1] - xs[a]) * rs.freqF / float(last - 1 - a) : 0.0f);
+	}
+
+	template<bool Hashed>
+	static void coherentScalarT(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		for (int i = 0, end, ix; i < n; i = end)
+		{
+			end = cellRun(rs, xs, i, n, ix);
+
+			float c[5];
+			cellQuartic<Hashed>(rs, ix, ampl, c);
+
+			for (int a = i, last; a < end; a = last)
+			{
+				last = std::min(a + anchorInterval, end);
+
+				float s, h;
+				anchor(rs, xs, ix, a, last, s, h);
+				stepQuartic(c, s, h, out + a, last - a);
+			}
+		}
+	}
+
+	static void coherentScalar(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			coherentScalarT<true>(rs, xs, ampl, out, n);
+		else
+			coherentScalarT<false>(rs, xs, ampl, out, n);
+	}
+
+#if PERLIN_X86_SIMD
+	static __m128 interpolate4(__m128 a0, __m128 a1, __m128 w)
+	{
+		__m128 t = _mm_mul_ps(_mm_sub_ps(a1, a0), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(w, _mm_set1_ps(2.0f))));
+		return _mm_add_ps(a0, _mm_mul_ps(_mm_mul_ps(t, w), w));
+	}
+
+	static __m128 dot4(__m128 dx, const vf2* const* g, __m128 dy)
+	{
+		__m128 gx = _mm_set_ps(g[12]->x, g[8]->x, g[4]->x, g[0]->x);
+		__m128 gy = _mm_set_ps(g[12]->y, g[8]->y, g[4]->y, g[0]->y);
+		return _mm_add_ps(_mm_mul_ps(dx, gx), _mm_mul_ps(dy, gy));
+	}
+
+	template<bool Accumulate, bool Hashed>
+	static void rowSSE2T(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		const __m128 freq = _mm_set1_ps(rs.freqF);
+		const __m128 sy = _mm_set1_ps(rs.sy);
+		const __m128 dy1 = _mm_set1_ps(rs.dy1);
+		const __m128i one = _mm_set1_epi32(1);
+
+		alignas(16) int cell[4];
+		const vf2* g[16]; // four corners for each of the four lanes
+
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(xs + i);
+			__m128i ix = _mm_cvttps_epi32(_mm_mul_ps(x, freq));
+
+			__m128 sx = _mm_mul_ps(_mm_sub_ps(x, _mm_div_ps(_mm_cvtepi32_ps(ix), freq)), freq);
+			__m128 dx1 = _mm_mul_ps(_mm_sub_ps(x, _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(ix, one)), freq)), freq);
+
+			_mm_store_si128((__m128i*)cell, ix);
+			for (int l = 0; l < 4; l++)
+				cornerGradients<Hashed>(rs, cell[l], g + 4 * l);
+
+			__m128 d00 = dot4(sx, g + 0, sy);
+			__m128 d10 = dot4(dx1, g + 1, sy);
+			__m128 d01 = dot4(sx, g + 2, dy1);
+			__m128 d11 = dot4(dx1, g + 3, dy1);
+
+			__m128 noise = interpolate4(interpolate4(d00, d10, sx), interpolate4(d01, d11, sx), sy);
+			if (Accumulate)
+				noise = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_set1_ps(ampl), noise));
+			_mm_storeu_ps(out + i, noise);
+		}
+
+		for (; i < n; i++)
+			storeLane<Accumulate>(out + i, ampl, noiseLane<Hashed>(rs, xs[i]));
+	}
+
+	template<bool Accumulate>
+	static void rowSSE2(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			rowSSE2T<Accumulate, true>(rs, xs, ampl, out, n);
+		else
+			rowSSE2T<Accumulate, false>(rs, xs, ampl, out, n);
+	}
+
+	static void dot4Basis(__m128 dx, const vf2* const* g, __m128 dy, __m128& d0, __m128& d1)
+	{
+		__m128 gx = _mm_set_ps(g[12]->x, g[8]->x, g[4]->x, g[0]->x);
+		__m128 gy = _mm_set_ps(g[12]->y, g[8]->y, g[4]->y, g[0]->y);
+		d0 = _mm_add_ps(_mm_mul_ps(dx, gx), _mm_mul_ps(dy, gy));
+		d1 = _mm_sub_ps(_mm_mul_ps(dy, gx), _mm_mul_ps(dx, gy));
+	}
+
+	template<bool Hashed>
+	static void basisSSE2T(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		const __m128 freq = _mm_set1_ps(rs.freqF);
+		const __m128 sy = _mm_set1_ps(rs.sy);
+		const __m128 dy1 = _mm_set1_ps(rs.dy1);
+		const __m128i one = _mm_set1_epi32(1);
+
+		alignas(16) int cell[4];
+		const vf2* g[16];
+
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(xs + i);
+			__m128i ix = _mm_cvttps_epi32(_mm_mul_ps(x, freq));
+
+			__m128 sx = _mm_mul_ps(_mm_sub_ps(x, _mm_div_ps(_mm_cvtepi32_ps(ix), freq)), freq);
+			__m128 dx1 = _mm_mul_ps(_mm_sub_ps(x, _mm_div_ps(_mm_cvtepi32_ps(_mm_add_epi32(ix, one)), freq)), freq);
+
+			_mm_store_si128((__m128i*)cell, ix);
+			for (int l = 0; l < 4; l++)
+				cornerGradients<Hashed>(rs, cell[l], g + 4 * l);
+
+			__m128 a00, a10, a01, a11, p00, p10, p01, p11;
+			dot4Basis(sx, g + 0, sy, a00, p00);
+			dot4Basis(dx1, g + 1, sy, a10, p10);
+			dot4Basis(sx, g + 2, dy1, a01, p01);
+			dot4Basis(dx1, g + 3, dy1, a11, p11);
+
+			_mm_storeu_ps(out0 + i, interpolate4(interpolate4(a00, a10, sx), interpolate4(a01, a11, sx), sy));
+			_mm_storeu_ps(out1 + i, interpolate4(interpolate4(p00, p10, sx), interpolate4(p01, p11, sx), sy));
+		}
+
+		for (; i < n; i++)
+			basisLane<Hashed>(rs, xs[i], out0 + i, out1 + i);
+	}
+
+	static void basisSSE2(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		if (rs.hashed)
+			basisSSE2T<true>(rs, xs, out0, out1, n);
+		else
+			basisSSE2T<false>(rs, xs, out0, out1, n);
+	}
+
+	// forwardDifferences for four starting points
+	static void forwardDifferences4(const float* c, __m128 s, __m128 h, __m128* d)
+	{
+		const __m128 c4 = _mm_set1_ps(c[4]);
+		__m128 e1 = _mm_add_ps(_mm_set1_ps(c[1]), _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(2.0f * c[2]),
+		            _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(3.0f * c[3]), _mm_mul_ps(s, _mm_set1_ps(4.0f * c[4])))))));
+		__m128 e2 = _mm_add_ps(_mm_set1_ps(c[2]), _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(3.0f * c[3]), _mm_mul_ps(s, _mm_set1_ps(6.0f * c[4])))));
+		__m128 e3 = _mm_add_ps(_mm_set1_ps(c[3]), _mm_mul_ps(s, _mm_set1_ps(4.0f * c[4])));
+		__m128 h2 = _mm_mul_ps(h, h);
+		__m128 E1 = _mm_mul_ps(e1, h), E2 = _mm_mul_ps(e2, h2), E3 = _mm_mul_ps(_mm_mul_ps(e3, h2), h), E4 = _mm_mul_ps(_mm_mul_ps(c4, h2), h2);
+
+		d[0] = _mm_add_ps(_mm_set1_ps(c[0]), _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(c[1]), _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(c[2]),
+		       _mm_mul_ps(s, _mm_add_ps(_mm_set1_ps(c[3]), _mm_mul_ps(s, c4))))))));
+		d[1] = _mm_add_ps(_mm_add_ps(E1, E2), _mm_add_ps(E3, E4));
+		d[2] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.0f), E2), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(6.0f), E3), _mm_mul_ps(_mm_set1_ps(14.0f), E4)));
+		d[3] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(6.0f), E3), _mm_mul_ps(_mm_set1_ps(36.0f), E4));
+		d[4] = _mm_mul_ps(_mm_set1_ps(24.0f), E4);
+	}
+
+	template<bool Hashed>
+	static void coherentSSE2T(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+
+		for (int i = 0, end, ix; i < n; i = end)
+		{
+			end = cellRun(rs, xs, i, n, ix);
+
+			float c[5];
+			cellQuartic<Hashed>(rs, ix, ampl, c);
+
+			for (int a = i, last; a < end; a = last)
+			{
+				last = std::min(a + anchorInterval, end);
+
+				float s, h;
+				anchor(rs, xs, ix, a, last, s, h);
+
+				// four interleaved sequences, each stepping over every fourth pixel
+				__m128 d[5];
+				forwardDifferences4(c, _mm_add_ps(_mm_set1_ps(s), _mm_mul_ps(lane, _mm_set1_ps(h))), _mm_set1_ps(4.0f * h), d);
+
+				int p = a;
+				for (; p + 4 <= last; p += 4)
+				{
+					_mm_storeu_ps(out + p, _mm_add_ps(_mm_loadu_ps(out + p), d[0]));
+					d[0] = _mm_add_ps(d[0], d[1]);
+					d[1] = _mm_add_ps(d[1], d[2]);
+					d[2] = _mm_add_ps(d[2], d[3]);
+					d[3] = _mm_add_ps(d[3], d[4]);
+				}
+
+				alignas(16) float tail[4];
+				_mm_store_ps(tail, d[0]);
+				for (int l = 0; p < last; p++, l++)
+					out[p] += tail[l];
+			}
+		}
+	}
+
+	static void coherentSSE2(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			coherentSSE2T<true>(rs, xs, ampl, out, n);
+		else
+			coherentSSE2T<false>(rs, xs, ampl, out, n);
+	}
+
+	PERLIN_TARGET_AVX2 static __m256 interpolate8(__m256 a0, __m256 a1, __m256 w)
+	{
+		__m256 t = _mm256_mul_ps(_mm256_sub_ps(a1, a0), _mm256_sub_ps(_mm256_set1_ps(3.0f), _mm256_mul_ps(w, _mm256_set1_ps(2.0f))));
+		return _mm256_add_ps(a0, _mm256_mul_ps(_mm256_mul_ps(t, w), w));
+	}
+
+	PERLIN_TARGET_AVX2 static __m256 dot8(__m256 dx, const float* row, __m256i index, __m256 dy)
+	{
+		__m256 gx = _mm256_i32gather_ps(row, index, 4);
+		__m256 gy = _mm256_i32gather_ps(row + 1, index, 4);
+		return _mm256_add_ps(_mm256_mul_ps(dx, gx), _mm256_mul_ps(dy, gy));
+	}
+
+	// vectorised hashCorner, returns the float index of the gradient in hashedGradients
+	PERLIN_TARGET_AVX2 static __m256i hashCorner8(__m256i row, __m256i ix)
+	{
+		__m256i h = _mm256_xor_si256(row, _mm256_mullo_epi32(ix, _mm256_set1_epi32(0x27D4EB2F)));
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+		h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x2C1B3C6D));
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 12));
+		h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x297A2D39));
+		h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+		return _mm256_slli_epi32(_mm256_srli_epi32(h, 24), 1);
+	}
+
+	template<bool Accumulate, bool Hashed>
+	PERLIN_TARGET_AVX2 static void rowAVX2T(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		const __m256 freq = _mm256_set1_ps(rs.freqF);
+		const __m256 sy = _mm256_set1_ps(rs.sy);
+		const __m256 dy1 = _mm256_set1_ps(rs.dy1);
+		const __m256i one = _mm256_set1_epi32(1);
+		const __m256i freqI = _mm256_set1_epi32(rs.freq);
+		const __m256i hash0 = _mm256_set1_epi32(int(rs.hash0));
+		const __m256i hash1 = _mm256_set1_epi32(int(rs.hash1));
+		const float* row0 = &rs.row0->x;
+		const float* row1 = &rs.row1->x;
+
+		int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 x = _mm256_loadu_ps(xs + i);
+			__m256i ix = _mm256_cvttps_epi32(_mm256_mul_ps(x, freq));
+			__m256i ix1 = _mm256_add_epi32(ix, one);
+
+			__m256 sx = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_div_ps(_mm256_cvtepi32_ps(ix), freq)), freq);
+			__m256 dx1 = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_div_ps(_mm256_cvtepi32_ps(ix1), freq)), freq);
+
+			__m256i g00, g10, g01, g11;
+			if (Hashed)
+			{
+				__m256i c1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(ix1, freqI), ix1);
+				g00 = hashCorner8(hash0, ix);
+				g10 = hashCorner8(hash0, c1);
+				g01 = hashCorner8(hash1, ix);
+				g11 = hashCorner8(hash1, c1);
+			}
+			else
+			{
+				// vf2 is two floats, so the float index of a gradient is twice its cell index
+				g00 = g01 = _mm256_slli_epi32(ix, 1);
+				g10 = g11 = _mm256_slli_epi32(ix1, 1);
+			}
+
+			__m256 ix0v = interpolate8(dot8(sx, row0, g00, sy), dot8(dx1, row0, g10, sy), sx);
+			__m256 ix1v = interpolate8(dot8(sx, row1, g01, dy1), dot8(dx1, row1, g11, dy1), sx);
+
+			__m256 noise = interpolate8(ix0v, ix1v, sy);
+			if (Accumulate)
+				noise = _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_set1_ps(ampl), noise));
+			_mm256_storeu_ps(out + i, noise);
+		}
+
+		for (; i < n; i++)
+			storeLane<Accumulate>(out + i, ampl, noiseLane<Hashed>(rs, xs[i]));
+	}
+
+	template<bool Accumulate>
+	static void rowAVX2(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			rowAVX2T<Accumulate, true>(rs, xs, ampl, out, n);
+		else
+			rowAVX2T<Accumulate, false>(rs, xs, ampl, out, n);
+	}
+
+	PERLIN_TARGET_AVX2 static void dot8Basis(__m256 dx, const float* row, __m256i index, __m256 dy, __m256& d0, __m256& d1)
+	{
+		__m256 gx = _mm256_i32gather_ps(row, index, 4);
+		__m256 gy = _mm256_i32gather_ps(row + 1, index, 4);
+		d0 = _mm256_add_ps(_mm256_mul_ps(dx, gx), _mm256_mul_ps(dy, gy));
+		d1 = _mm256_sub_ps(_mm256_mul_ps(dy, gx), _mm256_mul_ps(dx, gy));
+	}
+
+	template<bool Hashed>
+	PERLIN_TARGET_AVX2 static void basisAVX2T(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		const __m256 freq = _mm256_set1_ps(rs.freqF);
+		const __m256 sy = _mm256_set1_ps(rs.sy);
+		const __m256 dy1 = _mm256_set1_ps(rs.dy1);
+		const __m256i one = _mm256_set1_epi32(1);
+		const __m256i freqI = _mm256_set1_epi32(rs.freq);
+		const __m256i hash0 = _mm256_set1_epi32(int(rs.hash0));
+		const __m256i hash1 = _mm256_set1_epi32(int(rs.hash1));
+		const float* row0 = &rs.row0->x;
+		const float* row1 = &rs.row1->x;
+
+		int i = 0;
+		for (; i + 8 <= n; i += 8)
+		{
+			__m256 x = _mm256_loadu_ps(xs + i);
+			__m256i ix = _mm256_cvttps_epi32(_mm256_mul_ps(x, freq));
+			__m256i ix1 = _mm256_add_epi32(ix, one);
+
+			__m256 sx = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_div_ps(_mm256_cvtepi32_ps(ix), freq)), freq);
+			__m256 dx1 = _mm256_mul_ps(_mm256_sub_ps(x, _mm256_div_ps(_mm256_cvtepi32_ps(ix1), freq)), freq);
+
+			__m256i g00, g10, g01, g11;
+			if (Hashed)
+			{
+				__m256i c1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(ix1, freqI), ix1);
+				g00 = hashCorner8(hash0, ix);
+				g10 = hashCorner8(hash0, c1);
+				g01 = hashCorner8(hash1, ix);
+				g11 = hashCorner8(hash1, c1);
+			}
+			else
+			{
+				g00 = g01 = _mm256_slli_epi32(ix, 1);
+				g10 = g11 = _mm256_slli_epi32(ix1, 1);
+			}
+
+			__m256 a00, a10, a01, a11, p00, p10, p01, p11;
+			dot8Basis(sx, row0, g00, sy, a00, p00);
+			dot8Basis(dx1, row0, g10, sy, a10, p10);
+			dot8Basis(sx, row1, g01, dy1, a01, p01);
+			dot8Basis(dx1, row1, g11, dy1, a11, p11);
+
+			_mm256_storeu_ps(out0 + i, interpolate8(interpolate8(a00, a10, sx), interpolate8(a01, a11, sx), sy));
+			_mm256_storeu_ps(out1 + i, interpolate8(interpolate8(p00, p10, sx), interpolate8(p01, p11, sx), sy));
+		}
+
+		for (; i < n; i++)
+			basisLane<Hashed>(rs, xs[i], out0 + i, out1 + i);
+	}
+
+	static void basisAVX2(const RowState& rs, const float* xs, float* out0, float* out1, int n)
+	{
+		if (rs.hashed)
+			basisAVX2T<true>(rs, xs, out0, out1, n);
+		else
+			basisAVX2T<false>(rs, xs, out0, out1, n);
+	}
+
+	PERLIN_TARGET_AVX2 static void forwardDifferences8(const float* c, __m256 s, __m256 h, __m256* d)
+	{
+		const __m256 c4 = _mm256_set1_ps(c[4]);
+		__m256 e1 = _mm256_add_ps(_mm256_set1_ps(c[1]), _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(2.0f * c[2]),
+		            _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(3.0f * c[3]), _mm256_mul_ps(s, _mm256_set1_ps(4.0f * c[4])))))));
+		__m256 e2 = _mm256_add_ps(_mm256_set1_ps(c[2]), _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(3.0f * c[3]), _mm256_mul_ps(s, _mm256_set1_ps(6.0f * c[4])))));
+		__m256 e3 = _mm256_add_ps(_mm256_set1_ps(c[3]), _mm256_mul_ps(s, _mm256_set1_ps(4.0f * c[4])));
+		__m256 h2 = _mm256_mul_ps(h, h);
+		__m256 E1 = _mm256_mul_ps(e1, h), E2 = _mm256_mul_ps(e2, h2), E3 = _mm256_mul_ps(_mm256_mul_ps(e3, h2), h), E4 = _mm256_mul_ps(_mm256_mul_ps(c4, h2), h2);
+
+		d[0] = _mm256_add_ps(_mm256_set1_ps(c[0]), _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(c[1]), _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(c[2]),
+		       _mm256_mul_ps(s, _mm256_add_ps(_mm256_set1_ps(c[3]), _mm256_mul_ps(s, c4))))))));
+		d[1] = _mm256_add_ps(_mm256_add_ps(E1, E2), _mm256_add_ps(E3, E4));
+		d[2] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.0f), E2), _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(6.0f), E3), _mm256_mul_ps(_mm256_set1_ps(14.0f), E4)));
+		d[3] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(6.0f), E3), _mm256_mul_ps(_mm256_set1_ps(36.0f), E4));
+		d[4] = _mm256_mul_ps(_mm256_set1_ps(24.0f), E4);
+	}
+
+	template<bool Hashed>
+	PERLIN_TARGET_AVX2 static void coherentAVX2T(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		const __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+
+		for (int i = 0, end, ix; i < n; i = end)
+		{
+			end = cellRun(rs, xs, i, n, ix);
+
+			float c[5];
+			cellQuartic<Hashed>(rs, ix, ampl, c);
+
+			for (int a = i, last; a < end; a = last)
+			{
+				last = std::min(a + anchorInterval, end);
+
+				float s, h;
+				anchor(rs, xs, ix, a, last, s, h);
+
+				__m256 d[5];
+				forwardDifferences8(c, _mm256_add_ps(_mm256_set1_ps(s), _mm256_mul_ps(lane, _mm256_set1_ps(h))), _mm256_set1_ps(8.0f * h), d);
+
+				int p = a;
+				for (; p + 8 <= last; p += 8)
+				{
+					_mm256_storeu_ps(out + p, _mm256_add_ps(_mm256_loadu_ps(out + p), d[0]));
+					d[0] = _mm256_add_ps(d[0], d[1]);
+					d[1] = _mm256_add_ps(d[1], d[2]);
+					d[2] = _mm256_add_ps(d[2], d[3]);
+					d[3] = _mm256_add_ps(d[3], d[4]);
+				}
+
+				alignas(32) float tail[8];
+				_mm256_store_ps(tail, d[0]);
+				for (int l = 0; p < last; p++, l++)
+					out[p] += tail[l];
+			}
+		}
+	}
+
+	static void coherentAVX2(const RowState& rs, const float* xs, float ampl, float* out, int n)
+	{
+		if (rs.hashed)
+			coherentAVX2T<true>(rs, xs, ampl, out, n);
+		else
+			coherentAVX2T<false>(rs, xs, ampl, out, n);
+	}
+#endif
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads that split a loop into one contiguous band per thread.
+// The bands only depend on the item count and the thread count, and every item is
+// written by exactly one band, so the output is the same as running it serially.
+// run() isn't reentrant, only one thread at a time should use a pool.
+class ThreadPool
+{
+public:
+        typedef std::function<void(int begin, int end)> Task;
+
+        explicit ThreadPool(int threads = defaultThreads()) { resize(threads); }
+
+        ~ThreadPool() { stop(); }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        static int defaultThreads()
+        {
+                unsigned int n = std::thread::hardware_concurrency();
+                return (n == 0 ? 1 : int(n));
+        }
+
+        int size() const { return threadCount; }
+
+        // the calling thread counts as one of the threads
+        void resize(int threads)
+        {
+                stop();
+
+                threadCount = std::max(1, threads);
+                bandMs.assign(threadCount, 0.0);
+
+                quit = false;
+                for(int i = 1; i < threadCount; i++)
+                        workers.emplace_back(&ThreadPool::work, this, i, generation);
+        }
+
+        // calls task on the bands of [0, count) and returns once all of them are done
+        void run(int count, const Task& task)
+        {
+                if(threadCount == 1 || count <= 1)
+                {
+                        current = &task;
+                        itemCount = count;
+                        std::fill(bandMs.begin(), bandMs.end(), 0.0);
+                        runBand(0, 1);
+                        return;
+                }
+
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        current = &task;
+                        itemCount = count;
+                        pending = threadCount - 1;
+                        generation++;
+                }
+                start.notify_all();
+
+                runBand(0, threadCount);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                done.wait(lock, [this] { return pending == 0; });
+        }
+
+        // how long each thread spent on its band in the last run, in milliseconds
+        const std::vector<double>& bandTimes() const { return bandMs; }
+
+private:
+        int threadCount = 0;
+        std::vector<std::thread> workers;
+        std::vector<double> bandMs;
+
+        std::mutex mutex;
+        std::condition_variable start;
+        std::condition_variable done;
+
+        const Task* current = nullptr;
+        int itemCount = 0;
+        int pending = 0;
+        unsigned int generation = 0;
+        bool quit = false;
+
+        void runBand(int band, int bands)
+        {
+                auto t0 = std::chrono::steady_clock::now();
+
+                int begin = int((long long)itemCount * band / bands);
+                int end = int((long long)itemCount * (band + 1) / bands);
+                if(begin < end)
+                        (*current)(begin, end);
+
+                bandMs[band] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        }
+
+        void work(int band, unsigned int seen)
+        {
+                for(;;)
+                {
+                        {
+                                std::unique_lock<std::mutex> lock(mutex);
+                                start.wait(lock, [&] { return quit || generation != seen; });
+                                if(quit)
+                                        return;
+                                seen = generation;
+                        }
+
+                        runBand(band, threadCount);
+
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if(--pending == 0)
+                                done.notify_one();
+                }
+        }
+
+        void stop()
+        {
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        quit = true;
+                }
+                start.notify_all();
+
+                for(auto& worker : workers)
+                        worker.join();
+                workers.clear();
+        }
+};